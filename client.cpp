@@ -0,0 +1,185 @@
+#include "protocol.h"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifndef _WIN32
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <signal.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+int main(int argc, char** argv)
+{
+    cerr << "The client needs Unix domain sockets, which this platform doesn't have." << endl;
+    return -1;
+}
+
+#else
+
+void printUsage(const char* program)
+{
+    cout << "Usage: " << program << " <socket> <in.jpg> <out.jpg> [options]" << endl
+        << "  --mode <name>    serial, cpu, gpu, hybrid, stream, stream-cl, threads, luma, transcode, multi or auto (default serial)" << endl
+        << "  --gray           write a one channel image" << endl
+        << "  --inline         send the jpeg over the socket instead of the paths" << endl
+        << "  --repeat <n>     send the job n times and report min and median" << endl;
+}
+
+// the daemon has its own working directory
+string absolutePath(const string& path)
+{
+    if (!path.empty() && path[0] == '/')
+        return path;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return path;
+    return string(cwd) + "/" + path;
+}
+
+int readFile(const char* name, string& data)
+{
+    FILE* file = fopen(name, "rb");
+    if (file == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    data.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    const size_t read = fread(&data[0], 1, data.size(), file);
+    fclose(file);
+    return read == data.size() ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        printUsage(argv[0]);
+        return -1;
+    }
+    string mode = "serial";
+    bool gray = false;
+    bool inlineJob = false;
+    int repeat = 1;
+    for (int i = 4; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc)
+            mode = argv[++i];
+        else if (arg == "--gray")
+            gray = true;
+        else if (arg == "--inline")
+            inlineJob = true;
+        else if (arg == "--repeat" && i + 1 < argc)
+            repeat = max(1, atoi(argv[++i]));
+        else
+        {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    string input;
+    string output;
+    if (inlineJob)
+    {
+        if (readFile(argv[2], input) == -1)
+        {
+            cerr << "Can't read " << argv[2] << "." << endl;
+            return -1;
+        }
+    }
+    else
+    {
+        input = absolutePath(argv[2]);
+        output = absolutePath(argv[3]);
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(address.sun_path))
+    {
+        cerr << "Socket path is too long." << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, argv[1]);
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1 || connect(server, (sockaddr*)&address, sizeof(address)) == -1)
+    {
+        cerr << "No daemon is listening on " << argv[1] << "." << endl;
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    JobRequest request;
+    request.magic = JOB_MAGIC;
+    request.kind = inlineJob ? JOB_INLINE : JOB_PATHS;
+    request.channels = gray ? 1 : 3;
+    request.modeLength = mode.size();
+    request.inLength = input.size();
+    request.outLength = output.size();
+
+    vector<double> roundTrips;
+    vector<double> jobTimes;
+    string jpeg;
+    for (int i = 0; i < repeat; ++i)
+    {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        JobReply reply;
+        if (!writeFully(server, &request, sizeof(request)) || !writeFully(server, mode.data(), mode.size())
+            || !writeFully(server, input.data(), input.size()) || !writeFully(server, output.data(), output.size())
+            || !readFully(server, &reply, sizeof(reply)))
+        {
+            cerr << "The daemon hung up." << endl;
+            close(server);
+            return -1;
+        }
+        jpeg.resize(reply.length);
+        if (!readFully(server, &jpeg[0], jpeg.size()))
+        {
+            cerr << "The daemon hung up." << endl;
+            close(server);
+            return -1;
+        }
+        roundTrips.push_back(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+        if (reply.status != 0)
+        {
+            cerr << "The job failed, see the daemon's output." << endl;
+            close(server);
+            return -1;
+        }
+        jobTimes.push_back(reply.elapsed);
+    }
+    close(server);
+
+    if (inlineJob)
+    {
+        FILE* file = fopen(argv[3], "wb");
+        if (file == NULL || fwrite(jpeg.data(), 1, jpeg.size(), file) != jpeg.size())
+        {
+            cerr << "Can't write " << argv[3] << "." << endl;
+            if (file != NULL)
+                fclose(file);
+            return -1;
+        }
+        fclose(file);
+    }
+
+    sort(roundTrips.begin(), roundTrips.end());
+    sort(jobTimes.begin(), jobTimes.end());
+    cout << "Round trip: " << roundTrips.front() << " ms min, " << roundTrips[roundTrips.size() / 2] << " ms median" << endl;
+    cout << "In the daemon: " << jobTimes.front() << " ms min, " << jobTimes[jobTimes.size() / 2] << " ms median" << endl;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "daemon.h"
+#include "protocol.h"
+
+#include <cstdlib>
+#include <cstring>
+#ifndef _WIN32
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/time.h>
+    #include <signal.h>
+#endif
+
+#ifdef _WIN32
+
+int runDaemon(RunState& state, const char* socketPath)
+{
+    cerr << "The daemon needs Unix domain sockets, which this platform doesn't have." << endl;
+    return -1;
+}
+
+#else
+
+// set by SIGINT and SIGTERM, the daemon stops after the current job
+volatile sig_atomic_t stopDaemon = 0;
+
+void onStopSignal(int)
+{
+    stopDaemon = 1;
+}
+
+// a client that sends or takes nothing for this long is dropped,
+// so it can't keep the ones queued behind it waiting
+const int CLIENT_IDLE_SECONDS = 5;
+
+// drop the images of the last job, the next one brings its own
+void releaseImage(RunState& state)
+{
+    alignedFree(state.pixels);
+    alignedFree(state.newPixels);
+    state.pixels = NULL;
+    state.newPixels = NULL;
+}
+
+// run one job, inline jobs get their output jpeg in jpeg and size
+int runJob(RunState& state, const JobRequest& request, const string& modeName, const string& input, const string& output,
+    unsigned char*& jpeg, unsigned long int& size)
+{
+    int mode = MODE_EXIT;
+    for (int m = MODE_SERIAL; m < MODE_COUNT; ++m)
+    {
+        if (modeName == MODE_NAMES[m])
+            mode = m;
+    }
+    if (mode == MODE_EXIT)
+    {
+        cerr << "Unknown mode: " << modeName << endl;
+        return -1;
+    }
+    if (request.channels != 1 && request.channels != 3)
+        return -1;
+    state.grayOutput = request.channels == 1;
+
+    releaseImage(state);
+    double elapsed;
+    if (request.kind == JOB_PATHS)
+    {
+        state.inName = input.c_str();
+        state.outName = output.c_str();
+        if (runMode(mode, state, elapsed) == -1)
+            return -1;
+        return isFileMode(mode) ? 0 : saveImage(state);
+    }
+
+    // the file modes need files to work on
+    if (isFileMode(mode))
+    {
+        cerr << "Streaming, luma and transcode modes only take paths." << endl;
+        return -1;
+    }
+    if (decodeImage((const unsigned char*)input.data(), input.size(), state.pixels, state.width, state.height) == -1)
+    {
+        cerr << "Invalid image." << endl;
+        return -1;
+    }
+    state.newPixels = (Pixel*)alignedMalloc(state.width * state.height * sizeof(Pixel), PAGE_ALIGNMENT);
+    if (runMode(mode, state, elapsed) == -1)
+        return -1;
+    return state.grayOutput
+        ? encodeGrayImage((unsigned char*)state.newPixels, state.width, state.height, jpeg, size)
+        : encodeImage(state.newPixels, state.width, state.height, jpeg, size);
+}
+
+// answer the jobs of one connection until the client hangs up
+void serveClient(RunState& state, const int client)
+{
+    JobRequest request;
+    while (!stopDaemon && readFully(client, &request, sizeof(request), &stopDaemon))
+    {
+        if (request.magic != JOB_MAGIC || (request.kind != JOB_PATHS && request.kind != JOB_INLINE)
+            || request.modeLength > JOB_MAX_NAME || request.inLength > JOB_MAX_INPUT || request.outLength > JOB_MAX_NAME)
+        {
+            cerr << "Dropping a client that doesn't speak the protocol." << endl;
+            break;
+        }
+        string modeName(request.modeLength, '\0');
+        string input(request.inLength, '\0');
+        string output(request.outLength, '\0');
+        if (!readFully(client, &modeName[0], modeName.size(), &stopDaemon) || !readFully(client, &input[0], input.size(), &stopDaemon)
+            || !readFully(client, &output[0], output.size(), &stopDaemon))
+            break;
+
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        unsigned char* jpeg = NULL;
+        unsigned long int size = 0;
+        JobReply reply;
+        reply.status = runJob(state, request, modeName, input, output, jpeg, size);
+        reply.reserved = 0;
+        reply.elapsed = elapsedSince(start);
+        reply.length = reply.status == 0 && jpeg != NULL ? size : 0;
+        const bool sent = writeFully(client, &reply, sizeof(reply), &stopDaemon) && writeFully(client, jpeg, reply.length, &stopDaemon);
+        free(jpeg);
+        if (!sent)
+            break;
+    }
+    releaseImage(state);
+}
+
+int runDaemon(RunState& state, const char* socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        cerr << "Socket path is too long." << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1)
+    {
+        cerr << "Can't create socket." << endl;
+        return -1;
+    }
+    // a socket file nobody answers on is left over from a daemon that didn't shut down
+    if (connect(server, (sockaddr*)&address, sizeof(address)) == 0)
+    {
+        cerr << "Another daemon is listening on " << socketPath << "." << endl;
+        close(server);
+        return -1;
+    }
+    unlink(socketPath);
+    if (bind(server, (sockaddr*)&address, sizeof(address)) == -1 || listen(server, 16) == -1)
+    {
+        cerr << "Can't listen on " << socketPath << "." << endl;
+        close(server);
+        return -1;
+    }
+
+    // no SA_RESTART, so a signal wakes accept() up
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStopSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // a client that hangs up early shouldn't take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // build every device's program now instead of in the first job
+    state.quiet = true;
+    for (auto const& device : state.clDevicesCPU)
+        getSession(state, device);
+    for (auto const& device : state.clDevicesGPU)
+        getSession(state, device);
+
+    cout << "Listening on " << socketPath << endl;
+    while (!stopDaemon)
+    {
+        const int client = accept(server, NULL, NULL);
+        if (client == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "Can't accept connections." << endl;
+            break;
+        }
+        timeval idle;
+        idle.tv_sec = CLIENT_IDLE_SECONDS;
+        idle.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        // one job at a time, the sessions and the thread pool aren't shared
+        serveClient(state, client);
+        close(client);
+    }
+
+    close(server);
+    unlink(socketPath);
+    cout << "Daemon stopped." << endl;
+    return 0;
+}
+
+#endif
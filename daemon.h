@@ -0,0 +1,10 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "engine.h"
+
+// serve jobs (see protocol.h) on a Unix domain socket until SIGINT or SIGTERM,
+// with every OpenCL device's program built up front and kept warm
+int runDaemon(RunState& state, const char* socketPath);
+
+#endif // DAEMON_H
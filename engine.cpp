@@ -0,0 +1,2321 @@
+#include "engine.h"
+
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <csetjmp>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define GRAYSCALE_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+// lets single functions use instruction sets the rest of the build doesn't assume
+#if defined(__GNUC__)
+    #define GRAYSCALE_TARGET(isa) __attribute__((target(isa)))
+#else
+    #define GRAYSCALE_TARGET(isa)
+#endif
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+// the output has channels (3 or 1) bytes per pixel
+void grayscaleScalar(const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+{
+    // iterate through all pixels.
+    for (unsigned long int i = 0; i < length; ++i)
+    {
+        const int r = pixels[i].r;
+        const int g = pixels[i].g;
+        const int b = pixels[i].b;
+
+        // algorithm for grayscaling the pixel
+        const int gray = (max(r, max(g, b)) + min(r, min(g, b))) / 2;
+        // another way but faster:
+        // const double gray_d = (r * 0.3 + g * 0.59 + b * 0.11);
+        // const int gray = (int)(gray_d + 0.5);
+
+        for (int c = 0; c < channels; ++c)
+            out[i * channels + c] = gray;
+    }
+}
+
+// SIMD versions of grayscaleScalar, they work on blocks of 16 pixels (48 bytes)
+// per 128-bit lane: shuffle the three channels of every pixel into the same byte
+// of three registers, take (max + min) / 2 with byte min/max, and shuffle the gray
+// bytes back out three times each, or store them as they are for one channel
+// output. the caller handles the tail.
+#ifdef GRAYSCALE_X86
+
+// from the three 16 byte loads of a block, pick channel 0, 1 and 2 of each pixel
+#define GRAYSCALE_SHUFFLE_MASKS(set) \
+    const auto c0a = set(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const auto c0b = set(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1); \
+    const auto c0c = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13); \
+    const auto c1a = set(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const auto c1b = set(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1); \
+    const auto c1c = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14); \
+    const auto c2a = set(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const auto c2b = set(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1); \
+    const auto c2c = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15); \
+    const auto out0 = set(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5); \
+    const auto out1 = set(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10); \
+    const auto out2 = set(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)
+
+// the gray values of one register worth of pixels, the operations are the
+// intrinsics for the register width and `one` holds 1 in every byte
+#define GRAYSCALE_BLOCK(shuffle, or_, max_, min_, avg, xor_, and_, sub, a, b, c, gray) \
+    { \
+        const auto ch0 = or_(or_(shuffle(a, c0a), shuffle(b, c0b)), shuffle(c, c0c)); \
+        const auto ch1 = or_(or_(shuffle(a, c1a), shuffle(b, c1b)), shuffle(c, c1c)); \
+        const auto ch2 = or_(or_(shuffle(a, c2a), shuffle(b, c2b)), shuffle(c, c2c)); \
+        const auto hi = max_(ch0, max_(ch1, ch2)); \
+        const auto lo = min_(ch0, min_(ch1, ch2)); \
+        /* avg rounds up, (hi + lo) / 2 rounds down */ \
+        gray = sub(avg(hi, lo), and_(xor_(hi, lo), one)); \
+    }
+
+GRAYSCALE_TARGET("sse4.1")
+unsigned long int grayscaleSSE41(const unsigned char* in, unsigned char* out, const int channels, const unsigned long int length)
+{
+    GRAYSCALE_SHUFFLE_MASKS(_mm_setr_epi8);
+    const __m128i one = _mm_set1_epi8(1);
+    unsigned long int i = 0;
+    for (; i + 16 <= length; i += 16, in += 48, out += 16 * channels)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*)in);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(in + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*)(in + 32));
+        __m128i gray;
+        GRAYSCALE_BLOCK(_mm_shuffle_epi8, _mm_or_si128, _mm_max_epu8, _mm_min_epu8, _mm_avg_epu8, _mm_xor_si128, _mm_and_si128, _mm_sub_epi8, a, b, c, gray);
+        if (channels == 1)
+        {
+            _mm_storeu_si128((__m128i*)out, gray);
+            continue;
+        }
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(gray, out0));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_shuffle_epi8(gray, out1));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_shuffle_epi8(gray, out2));
+    }
+    return i;
+}
+
+// byte shuffles don't cross 128-bit lanes, so every lane gets a block of its own
+GRAYSCALE_TARGET("avx2")
+unsigned long int grayscaleAVX2(const unsigned char* in, unsigned char* out, const int channels, const unsigned long int length)
+{
+    #define GRAYSCALE_SET256(...) _mm256_broadcastsi128_si256(_mm_setr_epi8(__VA_ARGS__))
+    GRAYSCALE_SHUFFLE_MASKS(GRAYSCALE_SET256);
+    #undef GRAYSCALE_SET256
+    const __m256i one = _mm256_set1_epi8(1);
+    unsigned long int i = 0;
+    for (; i + 32 <= length; i += 32, in += 96, out += 32 * channels)
+    {
+        __m256i v[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            v[j] = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + 16 * j)));
+            v[j] = _mm256_inserti128_si256(v[j], _mm_loadu_si128((const __m128i*)(in + 48 + 16 * j)), 1);
+        }
+        __m256i gray;
+        GRAYSCALE_BLOCK(_mm256_shuffle_epi8, _mm256_or_si256, _mm256_max_epu8, _mm256_min_epu8, _mm256_avg_epu8, _mm256_xor_si256, _mm256_and_si256, _mm256_sub_epi8, v[0], v[1], v[2], gray);
+        // the lanes hold consecutive blocks, so the gray bytes are already in order
+        if (channels == 1)
+        {
+            _mm256_storeu_si256((__m256i*)out, gray);
+            continue;
+        }
+        const __m256i o[3] = { _mm256_shuffle_epi8(gray, out0), _mm256_shuffle_epi8(gray, out1), _mm256_shuffle_epi8(gray, out2) };
+        for (int j = 0; j < 3; ++j)
+        {
+            _mm_storeu_si128((__m128i*)(out + 16 * j), _mm256_castsi256_si128(o[j]));
+            _mm_storeu_si128((__m128i*)(out + 48 + 16 * j), _mm256_extracti128_si256(o[j], 1));
+        }
+    }
+    return i;
+}
+
+GRAYSCALE_TARGET("avx512f,avx512bw")
+unsigned long int grayscaleAVX512(const unsigned char* in, unsigned char* out, const int channels, const unsigned long int length)
+{
+    #define GRAYSCALE_SET512(...) _mm512_broadcast_i32x4(_mm_setr_epi8(__VA_ARGS__))
+    GRAYSCALE_SHUFFLE_MASKS(GRAYSCALE_SET512);
+    #undef GRAYSCALE_SET512
+    const __m512i one = _mm512_set1_epi8(1);
+    unsigned long int i = 0;
+    for (; i + 64 <= length; i += 64, in += 192, out += 64 * channels)
+    {
+        __m512i v[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            v[j] = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)(in + 16 * j)));
+            v[j] = _mm512_inserti32x4(v[j], _mm_loadu_si128((const __m128i*)(in + 48 + 16 * j)), 1);
+            v[j] = _mm512_inserti32x4(v[j], _mm_loadu_si128((const __m128i*)(in + 96 + 16 * j)), 2);
+            v[j] = _mm512_inserti32x4(v[j], _mm_loadu_si128((const __m128i*)(in + 144 + 16 * j)), 3);
+        }
+        __m512i gray;
+        GRAYSCALE_BLOCK(_mm512_shuffle_epi8, _mm512_or_si512, _mm512_max_epu8, _mm512_min_epu8, _mm512_avg_epu8, _mm512_xor_si512, _mm512_and_si512, _mm512_sub_epi8, v[0], v[1], v[2], gray);
+        if (channels == 1)
+        {
+            _mm512_storeu_si512((void*)out, gray);
+            continue;
+        }
+        const __m512i o[3] = { _mm512_shuffle_epi8(gray, out0), _mm512_shuffle_epi8(gray, out1), _mm512_shuffle_epi8(gray, out2) };
+        for (int j = 0; j < 3; ++j)
+        {
+            _mm_storeu_si128((__m128i*)(out + 16 * j), _mm512_castsi512_si128(o[j]));
+            _mm_storeu_si128((__m128i*)(out + 48 + 16 * j), _mm512_extracti32x4_epi32(o[j], 1));
+            _mm_storeu_si128((__m128i*)(out + 96 + 16 * j), _mm512_extracti32x4_epi32(o[j], 2));
+            _mm_storeu_si128((__m128i*)(out + 144 + 16 * j), _mm512_extracti32x4_epi32(o[j], 3));
+        }
+    }
+    return i;
+}
+
+#undef GRAYSCALE_SHUFFLE_MASKS
+#undef GRAYSCALE_BLOCK
+
+#endif // GRAYSCALE_X86
+
+SimdLevel detectSimdLevel()
+{
+#if defined(GRAYSCALE_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    // the OS has to save the ymm/zmm registers too
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    bool avx2 = false;
+    bool avx512 = false;
+    if (maxLeaf >= 7)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+        avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0 && (xcr0 & 0xe6) == 0xe6;
+    }
+    if (avx512)
+        return SIMD_AVX512;
+    if (avx2)
+        return SIMD_AVX2;
+    if (sse41)
+        return SIMD_SSE41;
+#elif defined(GRAYSCALE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+SimdLevel simdLevel = detectSimdLevel();
+
+// filter into channels (3 for RGB, 1 for gray) bytes per pixel
+int grayscaleFilterTo(const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+{
+    const unsigned char* in = (const unsigned char*)pixels;
+    unsigned long int done = 0;
+#ifdef GRAYSCALE_X86
+    switch (simdLevel)
+    {
+        case SIMD_AVX512:
+            done = grayscaleAVX512(in, out, channels, length);
+            break;
+        case SIMD_AVX2:
+            done = grayscaleAVX2(in, out, channels, length);
+            break;
+        case SIMD_SSE41:
+            done = grayscaleSSE41(in, out, channels, length);
+            break;
+        default:
+            break;
+    }
+#endif
+    // whatever doesn't fill a whole block
+    grayscaleScalar(pixels + done, out + done * channels, channels, length - done);
+    return 0;
+}
+
+int grayscaleFilter(const Pixel* pixels, Pixel*& newPixels, const unsigned long int length)
+{
+    return grayscaleFilterTo(pixels, (unsigned char*)newPixels, 3, length);
+}
+
+// memory for pixel buffers that several threads write to,
+// so chunk boundaries can line up with cache lines
+void* alignedMalloc(const size_t size, const size_t alignment)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        return NULL;
+    return ptr;
+#endif
+}
+
+void alignedFree(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// pin worker index to core index
+void ThreadPool::pinWorker(const unsigned int index)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % thread::hardware_concurrency(), &cpus);
+    pthread_setaffinity_np(workers[index].native_handle(), sizeof(cpus), &cpus);
+#else
+    if (index == 0)
+        cerr << "Thread pinning is not supported on this platform." << endl;
+#endif
+}
+
+// grayscaleFilterTo with one contiguous range of pixels per worker
+int grayscaleFilterParallel(ThreadPool& pool, const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+{
+    const unsigned long int count = pool.size();
+    unsigned long int chunk = (length + count - 1) / count;
+    chunk = (chunk + PARALLEL_CHUNK_ALIGNMENT - 1) / PARALLEL_CHUNK_ALIGNMENT * PARALLEL_CHUNK_ALIGNMENT;
+    pool.run([&](const unsigned int index)
+    {
+        const unsigned long int begin = min(length, index * chunk);
+        const unsigned long int end = min(length, begin + chunk);
+        grayscaleFilterTo(pixels + begin, out + begin * channels, channels, end - begin);
+    });
+    return 0;
+}
+
+// spread a row of gray samples, stored at the start of pixels, to r, g and b
+// in place: going from the end, pixel i never covers a sample before i
+void expandGrayRow(struct Pixel* pixels, const unsigned long int width)
+{
+    const unsigned char* gray = (const unsigned char*)pixels;
+    for (unsigned long int i = width; i-- > 0;)
+    {
+        const unsigned char value = gray[i];
+        pixels[i].r = value;
+        pixels[i].g = value;
+        pixels[i].b = value;
+    }
+}
+
+// copy one decoded scanline into pixels,
+// expanding images that have less than three color components
+void copyScanline(const JSAMPLE* row, const int components, struct Pixel* pixels, const unsigned long int width)
+{
+    for (unsigned long i = 0; i < width; ++i)
+    {
+        // assign first color to red
+        pixels[i].r = row[components * i];
+        // but if a pixel contains more colors
+        if (components > 2)
+        {
+            pixels[i].g = row[components * i + 1];
+            pixels[i].b = row[components * i + 2];
+        }
+        else
+        {
+            pixels[i].g = pixels[i].r;
+            pixels[i].b = pixels[i].r;
+        }
+    }
+}
+
+// libjpeg calls exit() on errors by default, this jumps back
+// to the caller instead so one bad file doesn't end the program
+struct JpegError
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo)
+{
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+// a whole input file in memory for jpeg_mem_src,
+// mapped where the platform can so reading it costs no copies
+// and (prefaulted when the whole file is going to be read) only a few
+// large reads instead of many small ones
+struct MappedFile
+{
+    const unsigned char* data;
+    size_t size;
+    bool mapped;
+};
+
+int mapFile(const char* name, MappedFile& file, const bool whole = true)
+{
+    file.data = NULL;
+    file.size = 0;
+    file.mapped = false;
+#ifdef _WIN32
+    // no mapping without windows.h, one read of the whole file instead
+    FILE *handle;
+    if ((handle = fopen(name, "rb")) == NULL)
+        return -1;
+    fseek(handle, 0, SEEK_END);
+    const long size = ftell(handle);
+    fseek(handle, 0, SEEK_SET);
+    unsigned char* data = size > 0 ? (unsigned char*)malloc(size) : NULL;
+    if (data == NULL || fread(data, 1, size, handle) != (size_t)size)
+    {
+        free(data);
+        fclose(handle);
+        return -1;
+    }
+    fclose(handle);
+    file.data = data;
+    file.size = size;
+#else
+    const int fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // fault the whole file in up front instead of page by page
+    if (whole)
+        flags |= MAP_POPULATE;
+#endif
+    void* data = mmap(NULL, info.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    if (whole)
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+    file.data = (const unsigned char*)data;
+    file.size = info.st_size;
+    file.mapped = true;
+#endif
+    return 0;
+}
+
+void unmapFile(MappedFile& file)
+{
+#ifndef _WIN32
+    if (file.mapped)
+        munmap((void*)file.data, file.size);
+    else
+#endif
+        free((void*)file.data);
+    file.data = NULL;
+    file.size = 0;
+}
+
+// write a whole file with one write
+int writeFile(const char* name, const unsigned char* data, const size_t size)
+{
+    FILE *file;
+    if ((file = fopen(name, "wb")) == NULL)
+    {
+        cerr << "Can't open output file." << endl;
+        return -1;
+    }
+    // unbuffered, so stdio passes the buffer straight on
+    setvbuf(file, NULL, _IONBF, 0);
+    const bool written = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && written ? 0 : -1;
+}
+
+// read only the jpeg header, so the image can be validated
+// without decoding it
+int readImageInfo(const char* name, unsigned long int& width, unsigned long int& height)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError jerr;
+
+    // only the pages holding the header are faulted in
+    MappedFile file;
+    if (mapFile(name, file, false) == -1)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        unmapFile(file);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, file.data, file.size);
+    (void) jpeg_read_header(&cinfo, (boolean)true);
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+
+    jpeg_destroy_decompress(&cinfo);
+    unmapFile(file);
+    return 0;
+}
+
+// decode a jpeg held in memory into newly allocated pixels
+int decodeImage(const unsigned char* data, const size_t size, struct Pixel*& pixels, unsigned long int& width, unsigned long int& height)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError jerr;
+
+    // read jpeg header (width and height)
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpegErrorExit;
+    pixels = NULL;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        alignedFree(pixels);
+        pixels = NULL;
+        return -1;
+    }
+    // decompress jpeg format
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    (void) jpeg_read_header(&cinfo, (boolean)true);
+    (void) jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+
+    pixels = (Pixel*)alignedMalloc(width * height * sizeof(Pixel), PAGE_ALIGNMENT);
+
+    // row pointers straight into pixels, so libjpeg can decode as many rows
+    // per call as it likes (rec_outbuf_height) without a scratch row,
+    // they live in libjpeg's pool so an error jump can't leak them
+    JSAMPARRAY rows = (JSAMPARRAY)(*cinfo.mem->alloc_small) ((j_common_ptr) &cinfo, JPOOL_IMAGE, height * sizeof(JSAMPROW));
+    for (unsigned long int i = 0; i < height; ++i)
+        rows[i] = (JSAMPROW)(pixels + i * width);
+
+    if (cinfo.output_components == 3)
+    {
+        // ycbcr and rgb images come out as packed rgb, the same layout as Pixel
+        while (cinfo.output_scanline < cinfo.output_height)
+            (void) jpeg_read_scanlines(&cinfo, rows + cinfo.output_scanline, cinfo.output_height - cinfo.output_scanline);
+    }
+    else if (cinfo.output_components == 1)
+    {
+        // gray rows are decoded into the start of their own row and spread out in place
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            const JDIMENSION first = cinfo.output_scanline;
+            const JDIMENSION count = jpeg_read_scanlines(&cinfo, rows + first, cinfo.output_height - first);
+            for (JDIMENSION i = first; i < first + count; ++i)
+                expandGrayRow((Pixel*)rows[i], width);
+        }
+    }
+    else
+    {
+        // anything else (e.g. cmyk) goes through a scratch row
+        JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray) ((j_common_ptr) &cinfo, JPOOL_IMAGE, width * cinfo.output_components, 1);
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            const JDIMENSION row = cinfo.output_scanline;
+            (void) jpeg_read_scanlines(&cinfo, buffer, 1);
+            copyScanline(buffer[0], cinfo.output_components, pixels + row * width, width);
+        }
+    }
+
+    (void) jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
+
+int readImage(const char* name, struct Pixel*& pixels, unsigned long int& width, unsigned long int& height)
+{
+    MappedFile file;
+    if (mapFile(name, file) == -1)
+        return -1;
+    const int result = decodeImage(file.data, file.size, pixels, width, height);
+    unmapFile(file);
+    return result;
+}
+
+// encode rows of packed samples (3 for rgb, 1 for gray) into a malloc'ed jpeg,
+// the caller frees it
+int encodeSamples(const unsigned char* samples, const unsigned long int width, const unsigned long int height, const int components,
+    unsigned char*& jpeg, unsigned long int& size)
+{
+    struct jpeg_compress_struct cinfo;
+    JpegError jerr;
+
+    // start with room for most images, libjpeg moves to a bigger buffer of its own if it runs out
+    // (that one could only leak if encoding failed later on, which in memory it doesn't)
+    unsigned char* const initial = (unsigned char*)malloc(width * height * components / 4 + 4096);
+    jpeg = initial;
+    size = width * height * components / 4 + 4096;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpegErrorExit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        free(initial);
+        jpeg = NULL;
+        size = 0;
+        return -1;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg, &size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = components;
+    cinfo.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_start_compress(&cinfo, (boolean)true);
+
+    // rows are handed to libjpeg as they are, it only reads them
+    const unsigned long int rowStride = width * components;
+    JSAMPROW rows[16];
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        const JDIMENSION count = min((JDIMENSION)16, cinfo.image_height - cinfo.next_scanline);
+        for (JDIMENSION i = 0; i < count; ++i)
+            rows[i] = const_cast<unsigned char*>(samples) + (cinfo.next_scanline + i) * rowStride;
+        jpeg_write_scanlines(&cinfo, rows, count);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    if (jpeg != initial)
+        free(initial);
+    return 0;
+}
+
+int encodeImage(const struct Pixel* pixels, const unsigned long int width, const unsigned long int height, unsigned char*& jpeg, unsigned long int& size)
+{
+    // set the image to have three colors
+    // although the image size would be smaller
+    // if we just set it to one and change the color space to grayscaled
+    // (that is what encodeGrayImage is for)
+    return encodeSamples((const unsigned char*)pixels, width, height, 3, jpeg, size);
+}
+
+// encode a one channel image, a third of the data encodeImage compresses
+int encodeGrayImage(const unsigned char* gray, const unsigned long int width, const unsigned long int height, unsigned char*& jpeg, unsigned long int& size)
+{
+    return encodeSamples(gray, width, height, 1, jpeg, size);
+}
+
+// encode in memory and write the file in one go
+int writeImage(const char* name, const struct Pixel* pixels, const unsigned long int width, const unsigned long int height)
+{
+    unsigned char* jpeg;
+    unsigned long int size;
+    if (encodeImage(pixels, width, height, jpeg, size) == -1)
+        return -1;
+    const int result = writeFile(name, jpeg, size);
+    free(jpeg);
+    return result;
+}
+
+int writeGrayImage(const char* name, const unsigned char* gray, const unsigned long int width, const unsigned long int height)
+{
+    unsigned char* jpeg;
+    unsigned long int size;
+    if (encodeGrayImage(gray, width, height, jpeg, size) == -1)
+        return -1;
+    const int result = writeFile(name, jpeg, size);
+    free(jpeg);
+    return result;
+}
+
+// decode only the luminance of an image, one byte per pixel,
+// for YCbCr files libjpeg hands back the Y component as it is
+// and skips chroma upsampling and color conversion
+int decodeGrayImage(const unsigned char* data, const size_t size, unsigned char*& gray, unsigned long int& width, unsigned long int& height)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError jerr;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpegErrorExit;
+    gray = NULL;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        free(gray);
+        gray = NULL;
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    (void) jpeg_read_header(&cinfo, (boolean)true);
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    (void) jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    gray = (unsigned char*)malloc(width * height);
+
+    // decode straight into the plane, as many rows as libjpeg will give at once
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW rows[16];
+        const JDIMENSION count = min((JDIMENSION)16, cinfo.output_height - cinfo.output_scanline);
+        for (JDIMENSION i = 0; i < count; ++i)
+            rows[i] = gray + (cinfo.output_scanline + i) * width;
+        (void) jpeg_read_scanlines(&cinfo, rows, count);
+    }
+
+    (void) jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
+
+int readGrayImage(const char* name, unsigned char*& gray, unsigned long int& width, unsigned long int& height)
+{
+    MappedFile file;
+    if (mapFile(name, file) == -1)
+        return -1;
+    const int result = decodeGrayImage(file.data, file.size, gray, width, height);
+    unmapFile(file);
+    return result;
+}
+
+// turn a YCbCr or grayscale jpeg into a grayscale one without decoding pixels,
+// the Y component's DCT coefficients are copied over as they are (like jpegtran -grayscale)
+// so there is no IDCT, no color conversion and no requantization loss
+int transcodeGrayImage(const char* inName, const char* outName, unsigned long int& width, unsigned long int& height)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    // only one of the two is working at any time, they can share the handler
+    JpegError jerr;
+
+    MappedFile file;
+    if (mapFile(inName, file) == -1)
+        return -1;
+    // the coefficients are about as big as the input, so its size is a good start
+    unsigned char* const initial = (unsigned char*)malloc(file.size + 4096);
+    unsigned char* jpeg = initial;
+    unsigned long int size = file.size + 4096;
+
+    dinfo.err = jpeg_std_error(&jerr.mgr);
+    cinfo.err = &jerr.mgr;
+    jerr.mgr.error_exit = jpegErrorExit;
+    // so a failed create can still be destroyed
+    dinfo.mem = NULL;
+    cinfo.mem = NULL;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        free(initial);
+        unmapFile(file);
+        return -1;
+    }
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_src(&dinfo, file.data, file.size);
+    (void) jpeg_read_header(&dinfo, (boolean)true);
+    width = dinfo.image_width;
+    height = dinfo.image_height;
+
+    // Y has to be stored at full resolution to be used on its own
+    const bool luma = (dinfo.jpeg_color_space == JCS_YCbCr && dinfo.num_components == 3)
+        || (dinfo.jpeg_color_space == JCS_GRAYSCALE && dinfo.num_components == 1);
+    if (!luma || dinfo.comp_info[0].h_samp_factor != dinfo.max_h_samp_factor
+        || dinfo.comp_info[0].v_samp_factor != dinfo.max_v_samp_factor)
+    {
+        cerr << "Only YCbCr and grayscale images can be transcoded." << endl;
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        free(initial);
+        unmapFile(file);
+        return -1;
+    }
+
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&dinfo);
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+    // drop Cb and Cr, jpeg_set_colorspace resets the quantization table
+    // of the remaining component so it has to be kept by hand
+    const int quantTable = cinfo.comp_info[0].quant_tbl_no;
+    jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+    cinfo.comp_info[0].quant_tbl_no = quantTable;
+    jpeg_mem_dest(&cinfo, &jpeg, &size);
+    jpeg_write_coefficients(&cinfo, coefficients);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    (void) jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    unmapFile(file);
+
+    const int result = writeFile(outName, jpeg, size);
+    if (jpeg != initial)
+        free(initial);
+    free(jpeg);
+    return result;
+}
+
+// decode a band of scanlines, filter it and encode it right away, so only
+// two bands of input and output pixels are held in memory. a band is
+// filtered on a thread of its own while this one encodes the band before
+// and decodes the band after it
+int streamImage(const char* inName, const char* outName, const unsigned long int bandRows, const BandFilter& filter, unsigned long int& width, unsigned long int& height)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    // only this thread calls libjpeg, the two can share the handler
+    JpegError jerr;
+    // volatile, they are set after the error jump is
+    struct Pixel* volatile bands[2] = { NULL, NULL };
+    struct Pixel* volatile newBands[2] = { NULL, NULL };
+    // an error jump has to wait for the band being filtered
+    thread filtering;
+
+    MappedFile inFile;
+    if (mapFile(inName, inFile) == -1)
+        return -1;
+    // the output is written as it goes, a band at a time
+    FILE *outFile;
+    if ((outFile = fopen(outName, "wb")) == NULL)
+    {
+        cerr << "Can't open output file." << endl;
+        unmapFile(inFile);
+        return -1;
+    }
+
+    dinfo.err = jpeg_std_error(&jerr.mgr);
+    cinfo.err = &jerr.mgr;
+    jerr.mgr.error_exit = jpegErrorExit;
+    // so a failed create can still be destroyed
+    dinfo.mem = NULL;
+    cinfo.mem = NULL;
+    if (setjmp(jerr.jump))
+    {
+        if (filtering.joinable())
+            filtering.join();
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        unmapFile(inFile);
+        fclose(outFile);
+        for (int i = 0; i < 2; ++i)
+        {
+            alignedFree(bands[i]);
+            alignedFree(newBands[i]);
+        }
+        return -1;
+    }
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_src(&dinfo, inFile.data, inFile.size);
+    (void) jpeg_read_header(&dinfo, (boolean)true);
+    // let libjpeg convert grayscale and YCbCr images to rgb,
+    // then the decoder can write straight into the band
+    if (dinfo.jpeg_color_space == JCS_GRAYSCALE || dinfo.jpeg_color_space == JCS_YCbCr)
+        dinfo.out_color_space = JCS_RGB;
+    (void) jpeg_start_decompress(&dinfo);
+    width = dinfo.output_width;
+    height = dinfo.output_height;
+
+    jpeg_stdio_dest(&cinfo, outFile);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_start_compress(&cinfo, (boolean)true);
+
+    // two bands of pixels each way, with libjpeg row pointers into them
+    // that live in libjpeg's pool so an error jump can't leak them
+    JSAMPARRAY inRows = (JSAMPARRAY)(*dinfo.mem->alloc_small) ((j_common_ptr) &dinfo, JPOOL_IMAGE, 2 * bandRows * sizeof(JSAMPROW));
+    JSAMPARRAY outRows = (JSAMPARRAY)(*dinfo.mem->alloc_small) ((j_common_ptr) &dinfo, JPOOL_IMAGE, 2 * bandRows * sizeof(JSAMPROW));
+    for (int b = 0; b < 2; ++b)
+    {
+        bands[b] = (Pixel*)alignedMalloc(width * bandRows * sizeof(Pixel), PAGE_ALIGNMENT);
+        newBands[b] = (Pixel*)alignedMalloc(width * bandRows * sizeof(Pixel), PAGE_ALIGNMENT);
+        for (unsigned long int i = 0; i < bandRows; ++i)
+        {
+            inRows[b * bandRows + i] = (JSAMPROW)(bands[b] + i * width);
+            outRows[b * bandRows + i] = (JSAMPROW)(newBands[b] + i * width);
+        }
+    }
+
+    // anything that is not rgb by now (e.g. cmyk) goes through a scratch row
+    const bool direct = dinfo.output_components == 3;
+    JSAMPARRAY scratch = NULL;
+    if (!direct)
+        scratch = (*dinfo.mem->alloc_sarray) ((j_common_ptr) &dinfo, JPOOL_IMAGE, width * dinfo.output_components, 1);
+
+    // fill band b, libjpeg may hand back fewer rows than asked for, 0 at the end
+    auto decodeBand = [&](const int b) -> unsigned long int
+    {
+        unsigned long int rows = 0;
+        while (rows < bandRows && dinfo.output_scanline < dinfo.output_height)
+        {
+            if (direct)
+            {
+                rows += jpeg_read_scanlines(&dinfo, &inRows[b * bandRows + rows], bandRows - rows);
+            }
+            else
+            {
+                (void) jpeg_read_scanlines(&dinfo, scratch, 1);
+                copyScanline(scratch[0], dinfo.output_components, bands[b] + rows * width, width);
+                rows++;
+            }
+        }
+        return rows;
+    };
+    int filtered = 0;
+    auto startFilter = [&](const int b, const unsigned long int rows)
+    {
+        filtering = thread([&filter, &filtered, &bands, &newBands, b, rows, width]()
+        {
+            filtered = filter(bands[b], newBands[b], rows * width);
+        });
+    };
+
+    int result = 0;
+    unsigned long int rows[2];
+    int current = 0;
+    rows[current] = decodeBand(current);
+    if (rows[current] > 0)
+        startFilter(current, rows[current]);
+    while (rows[current] > 0)
+    {
+        const int next = 1 - current;
+        rows[next] = decodeBand(next);
+        filtering.join();
+        if (filtered != 0)
+        {
+            result = -1;
+            break;
+        }
+        if (rows[next] > 0)
+            startFilter(next, rows[next]);
+        (void) jpeg_write_scanlines(&cinfo, &outRows[current * bandRows], rows[current]);
+        current = next;
+    }
+
+    if (result == 0)
+    {
+        (void) jpeg_finish_decompress(&dinfo);
+        jpeg_finish_compress(&cinfo);
+    }
+    jpeg_destroy_decompress(&dinfo);
+    jpeg_destroy_compress(&cinfo);
+    unmapFile(inFile);
+    fclose(outFile);
+    for (int b = 0; b < 2; ++b)
+    {
+        alignedFree(bands[b]);
+        alignedFree(newBands[b]);
+    }
+    return result;
+}
+
+// options every OpenCL program is built with
+const char* const CL_BUILD_OPTIONS = "-cl-std=CL1.2";
+
+// 64-bit FNV-1a, good enough to name cache files
+uint64_t hashBytes(const char* data, const size_t length, uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int makeDirectory(const string& path)
+{
+#ifdef _WIN32
+    if (_mkdir(path.c_str()) == 0 || errno == EEXIST)
+        return 0;
+#else
+    if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST)
+        return 0;
+#endif
+    return -1;
+}
+
+// names a device, its driver and the build options,
+// what decides how a program is built and how it runs
+string deviceKey(const cl::Device& device)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    return platform.getInfo<CL_PLATFORM_NAME>() + "|" + platform.getInfo<CL_PLATFORM_VERSION>() + "|"
+        + device.getInfo<CL_DEVICE_NAME>() + "|" + device.getInfo<CL_DEVICE_VERSION>() + "|"
+        + device.getInfo<CL_DRIVER_VERSION>() + "|" + CL_BUILD_OPTIONS;
+}
+
+// cache file for a program built from sources for a device,
+// anything that changes the binary is part of the key
+string programCachePath(const cl::Device& device, const cl::Program::Sources& sources, const string& cacheDir)
+{
+    const string key = deviceKey(device);
+
+    uint64_t hash = hashBytes(key.c_str(), key.length());
+    for (auto const& source : sources)
+        hash = hashBytes(source.first, source.second, hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    return cacheDir + "/" + name;
+}
+
+// build the program for a device, loading the binary from the cache
+// directory when it has one and storing it there when it doesn't,
+// an empty cache directory turns caching off
+int buildProgram(const cl::Context& context, const cl::Device& device, const cl::Program::Sources& sources, const string& cacheDir, cl::Program& program)
+{
+    const vector<cl::Device> devices(1, device);
+    const string path = cacheDir.empty() ? string() : programCachePath(device, sources, cacheDir);
+
+    if (!path.empty())
+    {
+        ifstream cached(path.c_str(), ios::binary);
+        if (cached)
+        {
+            vector<char> binary((istreambuf_iterator<char>(cached)), istreambuf_iterator<char>());
+            cl::Program::Binaries binaries(1, make_pair((const void*)binary.data(), binary.size()));
+            cl_int err;
+            program = cl::Program(context, devices, binaries, NULL, &err);
+            // a binary the driver no longer accepts is simply rebuilt from source
+            if (err == CL_SUCCESS && program.build(devices, CL_BUILD_OPTIONS) == CL_SUCCESS)
+                return 0;
+        }
+    }
+
+    program = cl::Program(context, sources);
+    if (program.build(devices, CL_BUILD_OPTIONS) != CL_SUCCESS)
+    {
+        cerr << "OpenCL build failed: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << endl;
+        return -1;
+    }
+
+    if (!path.empty() && makeDirectory(cacheDir) == 0)
+    {
+        vector< ::size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+        vector<char*> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        if (sizes.size() == 1 && binaries.size() == 1 && binaries[0] != NULL)
+        {
+            // write to a temporary file first, so concurrent processes
+            // never load a half written binary
+            const string tmpPath = path + ".tmp";
+            ofstream out(tmpPath.c_str(), ios::binary | ios::trunc);
+            out.write(binaries[0], sizes[0]);
+            out.close();
+            if (!out || rename(tmpPath.c_str(), path.c_str()) != 0)
+                remove(tmpPath.c_str());
+        }
+        for (char* binary : binaries)
+            delete[] binary;
+    }
+    return 0;
+}
+
+double elapsedSince(const chrono::high_resolution_clock::time_point& start)
+{
+    chrono::high_resolution_clock::time_point finish = chrono::high_resolution_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / (double)1000000;
+}
+
+// find the OpenCL devices and read the kernels from kernelFile,
+// the serial modes still work without any device,
+// returns the number of platforms
+int loadDevices(RunState& state, const char* kernelFile)
+{
+    vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    if (platforms.size() == 0)
+        cerr << "No valid OpenCL platform." << endl;
+
+    // store devices from different platforms into lists
+    // where they should belong to
+    for (auto const& platform : platforms)
+    {
+        vector<cl::Device> clTmpCPU;
+        vector<cl::Device> clTmpGPU;
+
+        platform.getDevices(CL_DEVICE_TYPE_CPU, &clTmpCPU);
+        platform.getDevices(CL_DEVICE_TYPE_GPU, &clTmpGPU);
+
+        if (clTmpCPU.size() > 0)
+            copy(clTmpCPU.begin(), clTmpCPU.end(), back_inserter(state.clDevicesCPU));
+        if (clTmpGPU.size() > 0)
+            copy(clTmpGPU.begin(), clTmpGPU.end(), back_inserter(state.clDevicesGPU));
+    }
+
+    // read the OpenCL instructions from file
+    fstream clFile(kernelFile);
+    state.clSrc = string(istreambuf_iterator<char>(clFile), (istreambuf_iterator<char>()));
+    state.sources = cl::Program::Sources(1, make_pair(state.clSrc.c_str(), state.clSrc.length() + 1));
+    return (int)platforms.size();
+}
+
+int loadImage(RunState& state)
+{
+    if (state.pixels != NULL)
+        return 0;
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    if (readImage(state.inName, state.pixels, state.width, state.height) == -1)
+    {
+        cerr << "Invalid image file." << endl;
+        return -1;
+    }
+    state.decodeTime = elapsedSince(start);
+    state.newPixels = (Pixel*)alignedMalloc(state.width * state.height * sizeof(Pixel), PAGE_ALIGNMENT);
+    if (!state.quiet)
+        cout << "Image reading completed." << endl;
+    return 0;
+}
+
+// bytes per output pixel of the full frame modes
+int outputChannels(const RunState& state)
+{
+    return state.grayOutput ? 1 : 3;
+}
+
+// write the output of the last full frame run
+int saveImage(RunState& state)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    const int result = state.grayOutput
+        ? writeGrayImage(state.outName, (unsigned char*)state.newPixels, state.width, state.height)
+        : writeImage(state.outName, state.newPixels, state.width, state.height);
+    if (result == -1)
+        return -1;
+    state.encodeTime = elapsedSince(start);
+    return 0;
+}
+
+// pixels of the made up image devices are tuned and calibrated on
+const unsigned long int TUNE_PIXELS = 1 << 22;
+// measured runs per candidate, after one warm-up run
+const int TUNE_RUNS = 3;
+
+// fill pixels with noise, so no driver can take shortcuts on it
+void fillTestImage(Pixel* pixels, const unsigned long int length)
+{
+    for (unsigned long int i = 0; i < length; ++i)
+    {
+        const uint32_t noise = (uint32_t)i * 2654435761u;
+        pixels[i].r = noise >> 24;
+        pixels[i].g = noise >> 16;
+        pixels[i].b = noise >> 8;
+    }
+}
+
+// write a whole text file through a temporary one,
+// the same dance as the program cache
+void replaceFile(const string& path, const string& contents)
+{
+    const string tmpPath = path + ".tmp";
+    ofstream out(tmpPath.c_str(), ios::trunc);
+    out << contents;
+    out.close();
+    if (!out || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        remove(tmpPath.c_str());
+        cerr << "Can't write " << path << "." << endl;
+    }
+}
+
+// entry of a device's kernel in the tuning file
+string tuningKey(const cl::Device& device, const int channels)
+{
+    return deviceKey(device) + "|" + (channels == 1 ? "grayscaleGray" : "grayscale");
+}
+
+// the tuning file has one "variant <tab> work-group size <tab> key" line per entry
+void loadTuning(RunState& state)
+{
+    ifstream in(state.tuneFile.c_str());
+    string line;
+    while (getline(in, line))
+    {
+        const size_t first = line.find('\t');
+        const size_t second = first == string::npos ? string::npos : line.find('\t', first + 1);
+        if (second == string::npos)
+            continue;
+        const string name = line.substr(0, first);
+        KernelConfig config = { KERNEL_AUTO, strtoul(line.c_str() + first + 1, NULL, 10) };
+        for (int v = KERNEL_X1; v < KERNEL_VARIANT_COUNT; ++v)
+        {
+            if (name == KERNEL_NAMES[v])
+                config.variant = (KernelVariant)v;
+        }
+        if (config.variant != KERNEL_AUTO)
+            state.tuning[line.substr(second + 1)] = config;
+    }
+}
+
+void saveTuning(const RunState& state)
+{
+    ostringstream out;
+    for (auto const& entry : state.tuning)
+        out << KERNEL_NAMES[entry.second.variant] << "\t" << entry.second.local << "\t" << entry.first << endl;
+    replaceFile(state.tuneFile, out.str());
+}
+
+// time every kernel variant at every candidate work-group size on a made up
+// image and keep the fastest, by kernel time alone since the transfers are
+// the same for all of them
+int tuneSession(DeviceSession& session, const int channels, KernelConfig& best)
+{
+    Pixel* pixels = (Pixel*)alignedMalloc(TUNE_PIXELS * sizeof(Pixel), PAGE_ALIGNMENT);
+    unsigned char* out = (unsigned char*)alignedMalloc(TUNE_PIXELS * channels, PAGE_ALIGNMENT);
+    fillTestImage(pixels, TUNE_PIXELS);
+
+    double bestTime = -1;
+    for (int v = KERNEL_X1; v < KERNEL_VARIANT_COUNT; ++v)
+    {
+        for (auto const local : session.localSizes((KernelVariant)v, channels))
+        {
+            const KernelConfig config = { (KernelVariant)v, local };
+            // a candidate the driver turns down is skipped
+            if (session.setConfig(channels, config) == -1 || session.run(pixels, out, channels, TUNE_PIXELS) == -1)
+                continue;
+            session.resetProfile();
+            bool failed = false;
+            for (int run = 0; run < TUNE_RUNS && !failed; ++run)
+                failed = session.run(pixels, out, channels, TUNE_PIXELS) == -1;
+            const double time = session.getProfile().busy[PHASE_KERNEL];
+            if (!failed && (bestTime < 0 || time < bestTime))
+            {
+                best = config;
+                bestTime = time;
+            }
+        }
+    }
+    alignedFree(pixels);
+    alignedFree(out);
+    session.resetProfile();
+    if (bestTime < 0)
+        return -1;
+    return session.setConfig(channels, best);
+}
+
+// give a session the launch config tuned for its device and the kernel
+// for channels the first time it runs that kernel, tuning it when the
+// tuning file doesn't have it yet (or on --retune), unless a kernel
+// variant was picked by hand
+void configureSession(RunState& state, DeviceSession& session, const int channels)
+{
+    if (session.isConfigured(channels))
+        return;
+    session.markConfigured(channels);
+    if (state.kernelVariant != KERNEL_AUTO || state.tuneFile.empty())
+        return;
+    if (!state.tuningLoaded)
+    {
+        loadTuning(state);
+        state.tuningLoaded = true;
+    }
+    const string key = tuningKey(session.getDevice(), channels);
+    auto const found = state.tuning.find(key);
+    if (!state.retune && found != state.tuning.end() && session.setConfig(channels, found->second) == 0)
+        return;
+    KernelConfig best;
+    if (tuneSession(session, channels, best) == -1)
+        return;
+    state.tuning[key] = best;
+    if (!state.quiet)
+    {
+        cout << "Tuned " << session.getDevice().getInfo<CL_DEVICE_NAME>() << (channels == 1 ? " gray" : " RGB") << " output: "
+            << KERNEL_NAMES[best.variant] << " kernel, work-group size " << (best.local > 0 ? to_string(best.local) : "left to the driver") << endl;
+    }
+    saveTuning(state);
+}
+
+// whether splitting images into strips pays off on a session's device:
+// whole runs on a made up image in one strip and in as many as the
+// session's own split by size makes (see DeviceSession::stripPixels),
+// 0 to split by size if that is faster and 1 not to split
+unsigned long int measureOverlap(RunState& state, DeviceSession& session)
+{
+    // nothing is transferred to overlap
+    if (session.usesZeroCopy())
+        return 1;
+    const int channels = outputChannels(state);
+    Pixel* pixels = (Pixel*)alignedMalloc(TUNE_PIXELS * sizeof(Pixel), PAGE_ALIGNMENT);
+    unsigned char* out = (unsigned char*)alignedMalloc(TUNE_PIXELS * channels, PAGE_ALIGNMENT);
+    fillTestImage(pixels, TUNE_PIXELS);
+
+    unsigned long int best = 1;
+    double bestTime = -1;
+    for (const unsigned long int chunks : { 1ul, 0ul })
+    {
+        // the first run sets up the buffers
+        session.setOverlap(chunks);
+        int result = session.run(pixels, out, channels, TUNE_PIXELS);
+        double time = -1;
+        for (int run = 0; run < TUNE_RUNS && result == 0; ++run)
+        {
+            chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+            result = session.run(pixels, out, channels, TUNE_PIXELS);
+            const double elapsed = elapsedSince(start);
+            time = time < 0 ? elapsed : min(time, elapsed);
+        }
+        if (result == 0 && (bestTime < 0 || time < bestTime))
+        {
+            best = chunks;
+            bestTime = time;
+        }
+    }
+    alignedFree(pixels);
+    alignedFree(out);
+    session.resetProfile();
+    if (!state.quiet)
+        cout << "Overlapped strips on " << session.getDevice().getInfo<CL_DEVICE_NAME>() << ": " << (best == 0 ? "faster, on" : "no faster, off") << endl;
+    return best;
+}
+
+// the context of the device's platform, set up on first use. NULL when the
+// platform has only the one device or the context can't be set up,
+// devices of other platforms never share it
+const PlatformContext* getPlatformContext(RunState& state, const cl::Device& device)
+{
+    const cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+    auto found = state.platformContexts.find(platform);
+    if (found == state.platformContexts.end())
+    {
+        PlatformContext& shared = state.platformContexts[platform];
+        shared.ready = false;
+        vector<cl::Device> devices;
+        for (auto const& list : { &state.clDevicesCPU, &state.clDevicesGPU })
+        {
+            for (auto const& other : *list)
+            {
+                if (other.getInfo<CL_DEVICE_PLATFORM>() == platform)
+                    devices.push_back(other);
+            }
+        }
+        if (devices.size() > 1)
+        {
+            cl_int err;
+            shared.context = cl::Context(devices, NULL, NULL, NULL, &err);
+            shared.ready = err == CL_SUCCESS;
+        }
+        found = state.platformContexts.find(platform);
+    }
+    return found->second.ready ? &found->second : NULL;
+}
+
+// the warm session for a device, set up on first use
+DeviceSession* getSession(RunState& state, const cl::Device& device)
+{
+    DeviceSession& session = state.sessions[device()];
+    const bool fresh = !session.ready();
+    if (fresh)
+    {
+        if (session.init(device, state.sources, state.cacheDir, state.zeroCopy, state.kernelVariant, getPlatformContext(state, device)) == -1)
+        {
+            cerr << "Can't set up OpenCL device." << endl;
+            state.sessions.erase(device());
+            return NULL;
+        }
+        if (state.tilePixels > 0)
+            session.limitTile(state.tilePixels);
+        // tune on whole strips, overlap is measured with the tuned kernel
+        session.setOverlap(state.overlapChunks > 0 ? state.overlapChunks : 1);
+    }
+    configureSession(state, session, outputChannels(state));
+    if (fresh && state.overlapChunks == 0)
+        session.setOverlap(measureOverlap(state, session));
+    // profile every session from the start of the run that uses it
+    if (find(state.profiled.begin(), state.profiled.end(), &session) == state.profiled.end())
+    {
+        session.resetProfile();
+        state.profiled.push_back(&session);
+    }
+    return &session;
+}
+
+// the scores file has one "pixels/s <tab> kernel pixels/s <tab> GB/s <tab> key" line per device
+void loadScores(RunState& state)
+{
+    ifstream in(state.scoreFile.c_str());
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        DeviceScore score;
+        string key;
+        if (fields >> score.pixelsPerSec >> score.kernelPixelsPerSec >> score.bandwidth && fields.get() == '\t' && getline(fields, key))
+        {
+            score.fresh = false;
+            state.deviceScores[key] = score;
+        }
+    }
+}
+
+void saveScores(const RunState& state)
+{
+    ostringstream out;
+    for (auto const& entry : state.deviceScores)
+    {
+        const DeviceScore& score = entry.second;
+        if (score.pixelsPerSec <= 0)
+            continue;
+        out << score.pixelsPerSec << "\t" << score.kernelPixelsPerSec << "\t" << score.bandwidth << "\t" << entry.first << endl;
+    }
+    replaceFile(state.scoreFile, out.str());
+}
+
+// time whole runs of the device's session on a made up image, the best one
+// counts, and take the kernel and transfer times from the same runs' profile
+int calibrateDevice(RunState& state, const cl::Device& device, DeviceScore& score)
+{
+    DeviceSession* session = getSession(state, device);
+    if (session == NULL)
+        return -1;
+    // calibrated on rgb output, whatever the run is for
+    configureSession(state, *session, 3);
+    Pixel* pixels = (Pixel*)alignedMalloc(TUNE_PIXELS * sizeof(Pixel), PAGE_ALIGNMENT);
+    unsigned char* out = (unsigned char*)alignedMalloc(TUNE_PIXELS * sizeof(Pixel), PAGE_ALIGNMENT);
+    fillTestImage(pixels, TUNE_PIXELS);
+
+    int result = session->run(pixels, out, 3, TUNE_PIXELS);
+    session->resetProfile();
+    double best = -1;
+    for (int run = 0; run < TUNE_RUNS && result == 0; ++run)
+    {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        result = session->run(pixels, out, 3, TUNE_PIXELS);
+        const double elapsed = elapsedSince(start);
+        best = best < 0 ? elapsed : min(best, elapsed);
+    }
+    if (result == 0)
+    {
+        const SessionProfile& profile = session->getProfile();
+        const double transfer = (profile.busy[PHASE_UPLOAD] + profile.busy[PHASE_READBACK]) / profile.runs;
+        score.pixelsPerSec = TUNE_PIXELS / best * 1000;
+        score.kernelPixelsPerSec = profile.busy[PHASE_KERNEL] > 0 ? TUNE_PIXELS / (profile.busy[PHASE_KERNEL] / profile.runs) * 1000 : 0;
+        // both ways, a zero copy device has nothing to measure
+        score.bandwidth = transfer > 0.001 ? 2 * TUNE_PIXELS * sizeof(Pixel) / (transfer * 1000000) : 0;
+    }
+    alignedFree(pixels);
+    alignedFree(out);
+    session->resetProfile();
+    return result;
+}
+
+// the device's score from the scores file, calibrating it
+// first if it isn't in there yet (or on --recalibrate)
+const DeviceScore& getDeviceScore(RunState& state, const cl::Device& device)
+{
+    if (!state.scoresLoaded)
+    {
+        if (!state.scoreFile.empty())
+            loadScores(state);
+        state.scoresLoaded = true;
+    }
+    const string key = deviceKey(device);
+    auto const found = state.deviceScores.find(key);
+    if (found != state.deviceScores.end() && (found->second.fresh || !state.recalibrate))
+        return found->second;
+
+    if (!state.quiet)
+        cout << "Calibrating " << device.getInfo<CL_DEVICE_NAME>() << "..." << endl;
+    DeviceScore& score = state.deviceScores[key];
+    score.fresh = true;
+    if (calibrateDevice(state, device, score) == -1)
+    {
+        // a device that can't run counts as the slowest, and isn't remembered
+        score.pixelsPerSec = 0;
+        score.kernelPixelsPerSec = 0;
+        score.bandwidth = 0;
+        return score;
+    }
+    if (!state.quiet)
+    {
+        cout << "  " << score.pixelsPerSec / 1000000 << " Mpixels/s, kernel " << score.kernelPixelsPerSec / 1000000
+            << " Mpixels/s, transfers " << score.bandwidth << " GB/s" << endl;
+    }
+    if (!state.scoreFile.empty())
+        saveScores(state);
+    return score;
+}
+
+// the fastest device of the list by measured pixels per second,
+// a list of one needs no measuring
+cl::Device selectDevice(RunState& state, const vector<cl::Device>& devices)
+{
+    cl::Device device = devices.front();
+    double fastest = -1;
+    if (devices.size() > 1)
+    {
+        for (auto const& candidate : devices)
+        {
+            const double speed = getDeviceScore(state, candidate).pixelsPerSec;
+            if (speed > fastest)
+            {
+                device = candidate;
+                fastest = speed;
+            }
+        }
+    }
+    return device;
+}
+
+// where the OpenCL time of the last run went, per device and phase,
+// plus how long the host took to decode and encode the image
+void printProfile(ostream& out, const RunState& state)
+{
+    for (auto const session : state.profiled)
+    {
+        const SessionProfile& profile = session->getProfile();
+        if (profile.runs == 0)
+            continue;
+        const KernelConfig& config = session->getConfig(outputChannels(state));
+        out << "Phase breakdown on " << session->getDevice().getInfo<CL_DEVICE_NAME>() << " (" << profile.runs << " runs, "
+            << KERNEL_NAMES[config.variant] << " kernel, work-group size " << (config.local > 0 ? to_string(config.local) : "auto")
+            << (session->usesZeroCopy() ? ", zero copy" : "") << "):" << endl;
+        if (profile.strips > profile.runs)
+            out << "  strips: " << profile.strips / profile.runs << " per run over " << STRIP_SLOTS << " queues, up to "
+                << session->getTilePixels(outputChannels(state)) << " pixels each" << endl;
+        double transfer = 0;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase)
+        {
+            out << "  " << PHASE_NAMES[phase] << ": " << profile.busy[phase] << " ms executing, "
+                << profile.waiting[phase] << " ms queued" << endl;
+            if (phase != PHASE_KERNEL)
+                transfer += profile.busy[phase];
+        }
+        // timeline of the first run, relative to when its upload was queued
+        const cl_ulong origin = profile.first[PHASE_UPLOAD].queued;
+        out << "  first run (ms since upload queued):" << endl;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase)
+        {
+            const CommandTimes& times = profile.first[phase];
+            out << "    " << PHASE_NAMES[phase] << ": queued " << (times.queued - origin) / 1000000.0
+                << ", submit " << (times.submit - origin) / 1000000.0
+                << ", start " << (times.start - origin) / 1000000.0
+                << ", end " << (times.end - origin) / 1000000.0 << endl;
+        }
+        const double total = transfer + profile.busy[PHASE_KERNEL];
+        if (total > 0)
+        {
+            out << "  " << (transfer > profile.busy[PHASE_KERNEL] ? "transfer-bound" : "compute-bound")
+                << ": transfers take " << 100 * transfer / total << "% of device time" << endl;
+        }
+    }
+    if (state.decodeTime >= 0)
+        out << "Host decode: " << state.decodeTime << " ms" << endl;
+    if (state.encodeTime >= 0)
+        out << "Host encode: " << state.encodeTime << " ms" << endl;
+}
+
+int runOpenCL(const cl::Device& device, RunState& state, double& elapsed)
+{
+    DeviceSession* session = getSession(state, device);
+    if (session == NULL)
+        return -1;
+
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    const int result = session->run(state.pixels, (unsigned char*)state.newPixels, outputChannels(state), state.width * state.height);
+    elapsed = elapsedSince(start);
+    return result;
+}
+
+// pick the workers of the hybrid mode from a comma separated list of
+// cpu, gpu (the fastest device of that type), cpuN, gpuN (the Nth one)
+// and host (a plain host thread), an empty list means the best CPU and GPU
+// or, when one of them is missing, every OpenCL device plus a host thread
+int makeHybridWorkers(RunState& state, vector<HybridWorker>& workers)
+{
+    vector<string> names;
+    string spec = state.hybridWorkers;
+    if (spec.empty())
+    {
+        if (state.clDevicesCPU.size() > 0 && state.clDevicesGPU.size() > 0)
+            spec = "cpu,gpu";
+        else
+        {
+            for (size_t i = 0; i < state.clDevicesCPU.size(); ++i)
+                spec += "cpu" + to_string(i) + ",";
+            for (size_t i = 0; i < state.clDevicesGPU.size(); ++i)
+                spec += "gpu" + to_string(i) + ",";
+            spec += "host";
+        }
+    }
+    size_t begin = 0;
+    while (begin <= spec.length())
+    {
+        size_t end = spec.find(',', begin);
+        if (end == string::npos)
+            end = spec.length();
+        if (end > begin)
+            names.push_back(spec.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    workers.clear();
+    for (auto const& name : names)
+    {
+        HybridWorker worker;
+        worker.session = NULL;
+        if (name == "host")
+        {
+            worker.name = "host thread";
+            workers.push_back(worker);
+            continue;
+        }
+
+        const bool gpu = name.compare(0, 3, "gpu") == 0;
+        const vector<cl::Device>& devices = gpu ? state.clDevicesGPU : state.clDevicesCPU;
+        if ((!gpu && name.compare(0, 3, "cpu") != 0) || devices.size() == 0)
+        {
+            cerr << "Unknown or missing hybrid worker: " << name << endl;
+            return -1;
+        }
+        cl::Device device;
+        if (name.length() == 3)
+            device = selectDevice(state, devices);
+        else
+        {
+            const size_t index = (size_t)atoi(name.c_str() + 3);
+            if (index >= devices.size())
+            {
+                cerr << "Unknown or missing hybrid worker: " << name << endl;
+                return -1;
+            }
+            device = devices[index];
+        }
+
+        // a session can only be driven by one thread
+        for (auto const& other : workers)
+        {
+            if (other.session != NULL && other.session->getDevice()() == device())
+            {
+                cerr << "Hybrid worker listed twice: " << name << endl;
+                return -1;
+            }
+        }
+        worker.session = getSession(state, device);
+        if (worker.session == NULL)
+            return -1;
+        worker.name = device.getInfo<CL_DEVICE_NAME>();
+        workers.push_back(worker);
+    }
+
+    if (workers.size() == 0)
+    {
+        cerr << "No hybrid workers." << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// when every device worker shares one platform context, the chunks are
+// filtered in sub-buffers of one input and one output buffer over the whole
+// image, instead of every chunk being copied to its device and back on its
+// own. chunk grows to the devices' base address alignment so every chunk's
+// region starts on it. devices on several contexts, or that then can't take
+// the image or the chunks in one go, keep copying
+int shareBuffers(vector<HybridWorker>& workers, RunState& state, unsigned long int& chunk)
+{
+    const unsigned long int length = state.width * state.height;
+    const int channels = outputChannels(state);
+
+    vector<HybridWorker*> devices;
+    unsigned long int alignment = PAGE_ALIGNMENT;
+    bool fits = true;
+    for (auto& worker : workers)
+    {
+        worker.in = cl::Buffer();
+        worker.out = cl::Buffer();
+        worker.queue = cl::CommandQueue();
+        if (worker.session == NULL)
+            continue;
+        devices.push_back(&worker);
+        fits = fits && worker.session->getContext()() == devices[0]->session->getContext()();
+        const cl_uint bits = worker.session->getDevice().getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>();
+        alignment = max(alignment, (unsigned long int)bits / 8);
+    }
+    const unsigned long int aligned = (chunk + alignment - 1) / alignment * alignment;
+    fits = fits && devices.size() > 1;
+    for (auto worker : devices)
+    {
+        fits = fits && length * sizeof(Pixel) <= worker->session->getDevice().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()
+            && aligned <= worker->session->getTilePixels(channels);
+    }
+    if (!fits)
+        return 0;
+
+    const cl::Context& context = devices[0]->session->getContext();
+    cl_int err;
+    cl::Buffer in(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, length * sizeof(Pixel), state.pixels, &err);
+    if (err != CL_SUCCESS)
+        return -1;
+    cl::Buffer out(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, length * channels, state.newPixels, &err);
+    if (err != CL_SUCCESS)
+        return -1;
+    for (auto& worker : workers)
+    {
+        worker.in = in;
+        worker.out = out;
+        // the host may only touch what the buffers wrap through a mapping (see filterMapped)
+        if (worker.session == NULL)
+        {
+            worker.queue = cl::CommandQueue(context, devices[0]->session->getDevice(), 0, &err);
+            if (err != CL_SUCCESS)
+                return -1;
+        }
+    }
+    chunk = aligned;
+    return 0;
+}
+
+// filter a host worker's chunk through mappings of its own sub-buffers
+// of the shared buffers, which are plain pointers into the image when
+// the buffers wrap it; mapping the parents while devices run on their
+// sub-buffers would overlap the regions they write
+int filterMapped(HybridWorker& worker, const unsigned long int begin, const unsigned long int size, const int channels)
+{
+    cl_int err;
+    cl_buffer_region inRegion = { begin * sizeof(Pixel), size * sizeof(Pixel) };
+    cl_buffer_region outRegion = { begin * channels, size * channels };
+    cl::Buffer inPart = worker.in.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &inRegion, &err);
+    if (err != CL_SUCCESS)
+        return -1;
+    cl::Buffer outPart = worker.out.createSubBuffer(CL_MEM_WRITE_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &outRegion, &err);
+    if (err != CL_SUCCESS)
+        return -1;
+    cl_int inErr;
+    cl_int outErr;
+    void* in = worker.queue.enqueueMapBuffer(inPart, CL_TRUE, CL_MAP_READ, 0, size * sizeof(Pixel), NULL, NULL, &inErr);
+    void* out = worker.queue.enqueueMapBuffer(outPart, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size * channels, NULL, NULL, &outErr);
+    if (inErr == CL_SUCCESS && outErr == CL_SUCCESS)
+        grayscaleFilterTo((const Pixel*)in, (unsigned char*)out, channels, size);
+    if (inErr == CL_SUCCESS)
+        worker.queue.enqueueUnmapMemObject(inPart, in);
+    if (outErr == CL_SUCCESS)
+        worker.queue.enqueueUnmapMemObject(outPart, out);
+    return worker.queue.finish() == CL_SUCCESS && inErr == CL_SUCCESS && outErr == CL_SUCCESS ? 0 : -1;
+}
+
+// every worker pulls the next chunk of the image off a shared counter
+// as soon as it is done with the last one, so faster devices end up
+// with a bigger share instead of everyone waiting for the slowest
+int runHybrid(vector<HybridWorker>& workers, RunState& state, double& elapsed)
+{
+    const unsigned long int length = state.width * state.height;
+    unsigned long int chunk = state.hybridChunk > 0 ? state.hybridChunk : max(HYBRID_MIN_CHUNK, length / HYBRID_CHUNKS);
+    // whole pages for zero copy
+    chunk = roundToPages(chunk, true);
+    if (shareBuffers(workers, state, chunk) == -1)
+        return -1;
+    const unsigned long int chunkCount = (length + chunk - 1) / chunk;
+
+    const int channels = outputChannels(state);
+    atomic<unsigned long int> nextChunk(0);
+    atomic<bool> failed(false);
+
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+    vector<thread> threads;
+    for (auto& worker : workers)
+    {
+        worker.pixelsDone = 0;
+        worker.chunksDone = 0;
+        worker.busy = 0;
+        threads.push_back(thread([&state, &worker, &nextChunk, &failed, chunk, chunkCount, length, channels]()
+        {
+            chrono::high_resolution_clock::time_point begun = chrono::high_resolution_clock::now();
+            while (!failed)
+            {
+                const unsigned long int index = nextChunk++;
+                if (index >= chunkCount)
+                    break;
+                const unsigned long int begin = index * chunk;
+                const unsigned long int size = min(chunk, length - begin);
+                unsigned char* out = (unsigned char*)state.newPixels + begin * channels;
+                if (worker.in() != NULL && worker.session != NULL)
+                {
+                    if (worker.session->runRegion(worker.in, worker.out, begin, size, channels) == -1)
+                        failed = true;
+                }
+                else if (worker.in() != NULL)
+                {
+                    if (filterMapped(worker, begin, size, channels) == -1)
+                        failed = true;
+                }
+                else if (worker.session != NULL)
+                {
+                    if (worker.session->run(state.pixels + begin, out, channels, size) == -1)
+                        failed = true;
+                }
+                else
+                {
+                    grayscaleFilterTo(state.pixels + begin, out, channels, size);
+                }
+                worker.pixelsDone += size;
+                worker.chunksDone++;
+            }
+            worker.busy = elapsedSince(begun);
+        }));
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    elapsed = elapsedSince(start);
+    // the buffers wrap this image's pixels, the next run gets its own
+    for (auto& worker : workers)
+    {
+        worker.in = cl::Buffer();
+        worker.out = cl::Buffer();
+        worker.queue = cl::CommandQueue();
+    }
+    return failed ? -1 : 0;
+}
+
+// a worker for every OpenCL device of every platform,
+// devices that can't be set up are left out
+int makeMultiWorkers(RunState& state, vector<HybridWorker>& workers)
+{
+    vector<cl::Device> devices(state.clDevicesCPU);
+    devices.insert(devices.end(), state.clDevicesGPU.begin(), state.clDevicesGPU.end());
+    workers.clear();
+    for (auto const& device : devices)
+    {
+        HybridWorker worker;
+        worker.session = getSession(state, device);
+        if (worker.session == NULL)
+            continue;
+        worker.name = device.getInfo<CL_DEVICE_NAME>();
+        workers.push_back(worker);
+    }
+    if (workers.size() == 0)
+    {
+        cerr << "No usable OpenCL device." << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// every device filters one slice of the image on its own thread and queue,
+// sized by how many pixels per ms it managed last run. before every device
+// has run, the slices go by the devices' calibrated speeds
+int runMulti(vector<HybridWorker>& workers, RunState& state, double& elapsed)
+{
+    const unsigned long int length = state.width * state.height;
+    const int channels = outputChannels(state);
+
+    vector<double> weights;
+    bool measured = true;
+    for (auto const& worker : workers)
+        measured = measured && state.deviceSpeeds.count(worker.session->getDevice()()) > 0;
+    double total = 0;
+    for (auto const& worker : workers)
+    {
+        const cl::Device& device = worker.session->getDevice();
+        weights.push_back(measured ? state.deviceSpeeds[device()] : getDeviceScore(state, device).pixelsPerSec);
+        total += weights.back();
+    }
+
+    atomic<bool> failed(false);
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+    vector<thread> threads;
+    unsigned long int begin = 0;
+    double weightSoFar = 0;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        // slices end on whole pages for zero copy, the last one takes the rest
+        weightSoFar += weights[i];
+        unsigned long int end = length;
+        if (i + 1 < workers.size() && total > 0)
+            end = min(length, roundToPages((unsigned long int)(length * (weightSoFar / total))));
+        end = max(begin, end);
+        HybridWorker& worker = workers[i];
+        worker.pixelsDone = end - begin;
+        worker.chunksDone = end > begin ? 1 : 0;
+        worker.busy = 0;
+        if (end > begin)
+        {
+            threads.push_back(thread([&state, &worker, &failed, begin, channels]()
+            {
+                chrono::high_resolution_clock::time_point begun = chrono::high_resolution_clock::now();
+                unsigned char* out = (unsigned char*)state.newPixels + begin * channels;
+                if (worker.session->run(state.pixels + begin, out, channels, worker.pixelsDone) == -1)
+                    failed = true;
+                worker.busy = elapsedSince(begun);
+            }));
+        }
+        begin = end;
+    }
+    for (auto& thread : threads)
+        thread.join();
+    elapsed = elapsedSince(start);
+    if (failed)
+        return -1;
+
+    // a device that got nothing to do this time keeps its old speed
+    for (auto const& worker : workers)
+    {
+        if (worker.pixelsDone > 0 && worker.busy > 0)
+            state.deviceSpeeds[worker.session->getDevice()()] = worker.pixelsDone / worker.busy;
+    }
+    return 0;
+}
+
+// how the last hybrid run ended up splitting the image
+void printHybridSplit(ostream& out, const vector<HybridWorker>& workers)
+{
+    unsigned long int total = 0;
+    for (auto const& worker : workers)
+        total += worker.pixelsDone;
+    out << "Split:";
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        out << (i > 0 ? "," : "") << " " << workers[i].name << " "
+            << (total > 0 ? 100.0 * workers[i].pixelsDone / total : 0) << "% (" << workers[i].chunksDone
+            << (workers[i].chunksDone == 1 ? " chunk, " : " chunks, ") << workers[i].busy << " ms)";
+    }
+    out << endl;
+}
+
+int runStreaming(const BandFilter& filter, RunState& state, double& elapsed)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    if (streamImage(state.inName, state.outName, STREAM_BAND_ROWS, filter, state.width, state.height) == -1)
+    {
+        cerr << "Streaming failed." << endl;
+        return -1;
+    }
+    elapsed = elapsedSince(start);
+    return 0;
+}
+
+// grayscale by luminance instead of lightness: decode the Y plane
+// and write it as a one channel image, there is nothing left to filter
+int runLuma(RunState& state, double& elapsed)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    unsigned char* gray;
+    if (readGrayImage(state.inName, gray, state.width, state.height) == -1)
+    {
+        cerr << "Invalid image file." << endl;
+        return -1;
+    }
+    const int result = writeGrayImage(state.outName, gray, state.width, state.height);
+    elapsed = elapsedSince(start);
+    free(gray);
+    return result;
+}
+
+// luma without decoding at all, see transcodeGrayImage
+int runTranscode(RunState& state, double& elapsed)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    if (transcodeGrayImage(state.inName, state.outName, state.width, state.height) == -1)
+    {
+        cerr << "Transcoding failed." << endl;
+        return -1;
+    }
+    elapsed = elapsedSince(start);
+    return 0;
+}
+
+// the modes the auto mode picks from
+const int AUTO_CANDIDATES[] = { MODE_SERIAL, MODE_HOST_THREADS, MODE_OPENCL_CPU, MODE_OPENCL_GPU, MODE_OPENCL_HYBRID, MODE_MULTI };
+// latest runs per mode the cost model is fitted to
+const size_t COST_SAMPLES = 32;
+// image sizes a mode without a cost model yet is timed at
+const unsigned long int COST_PROBE_PIXELS[] = { 1 << 14, 1 << 22 };
+// runs logged in memory before they are appended to the cost file
+const unsigned long int COST_FLUSH_RUNS = 16;
+
+bool isCostModeled(const int mode)
+{
+    return find(begin(AUTO_CANDIDATES), end(AUTO_CANDIDATES), mode) != end(AUTO_CANDIDATES);
+}
+
+// whether the mode can run with the devices at hand
+bool isAvailable(const RunState& state, const int mode)
+{
+    const size_t devices = state.clDevicesCPU.size() + state.clDevicesGPU.size();
+    switch (mode)
+    {
+        case MODE_OPENCL_CPU:
+            return state.clDevicesCPU.size() > 0;
+        case MODE_OPENCL_GPU:
+            return state.clDevicesGPU.size() > 0;
+        case MODE_OPENCL_HYBRID:
+            // a worker list is checked when it is set up, the default one
+            // puts any device next to a host thread
+            return !state.hybridWorkers.empty() || devices > 0;
+        case MODE_MULTI:
+            return devices > 1;
+    }
+    return true;
+}
+
+// keep the latest runs of a mode writing channels bytes per pixel
+void addCostSample(RunState& state, const int mode, const int channels, const CostSample& sample)
+{
+    vector<CostSample>& samples = state.costSamples[make_pair(mode, channels)];
+    samples.push_back(sample);
+    if (samples.size() > COST_SAMPLES)
+        samples.erase(samples.begin());
+}
+
+// the cost file logs one "mode <tab> channels <tab> pixels <tab> ms" line
+// per run (lines without the channels are RGB runs of older versions),
+// it's cut back to the runs the model uses once it has grown a lot
+void loadCosts(RunState& state)
+{
+    ifstream in(state.costFile.c_str());
+    string line;
+    size_t lines = 0;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        string name;
+        int channels = 3;
+        CostSample sample;
+        double values[3];
+        int count = 0;
+        if (!(fields >> name))
+            continue;
+        while (count < 3 && fields >> values[count])
+            count++;
+        if (count == 3)
+        {
+            channels = (int)values[0];
+            sample.pixels = (unsigned long int)values[1];
+            sample.elapsed = values[2];
+        }
+        else if (count == 2)
+        {
+            sample.pixels = (unsigned long int)values[0];
+            sample.elapsed = values[1];
+        }
+        else
+            continue;
+        lines++;
+        for (auto const mode : AUTO_CANDIDATES)
+        {
+            if (name == MODE_NAMES[mode])
+                addCostSample(state, mode, channels, sample);
+        }
+    }
+    if (lines > 2 * 4 * COST_SAMPLES * (sizeof(AUTO_CANDIDATES) / sizeof(AUTO_CANDIDATES[0])))
+    {
+        ostringstream out;
+        for (auto const& entry : state.costSamples)
+        {
+            for (auto const& sample : entry.second)
+                out << MODE_NAMES[entry.first.first] << "\t" << entry.first.second << "\t" << sample.pixels << "\t" << sample.elapsed << endl;
+        }
+        replaceFile(state.costFile, out.str());
+    }
+}
+
+// append the runs logged since the last flush to the cost file
+void flushCosts(RunState& state)
+{
+    if (state.costLogRuns == 0)
+        return;
+    ofstream out(state.costFile.c_str(), ios::app);
+    out << state.costLog;
+    state.costLog.clear();
+    state.costLogRuns = 0;
+}
+
+// the model always learns the run, the cost file gets it with the next flush
+void recordCost(RunState& state, const int mode, const unsigned long int pixels, const double elapsed)
+{
+    if (!state.costsLoaded && !state.costFile.empty())
+    {
+        loadCosts(state);
+        state.costsLoaded = true;
+    }
+    const int channels = outputChannels(state);
+    const CostSample sample = { pixels, elapsed };
+    addCostSample(state, mode, channels, sample);
+    if (state.costFile.empty())
+        return;
+    state.costLog += string(MODE_NAMES[mode]) + "\t" + to_string(channels) + "\t" + to_string(pixels) + "\t" + to_string(elapsed) + "\n";
+    if (++state.costLogRuns >= COST_FLUSH_RUNS)
+        flushCosts(state);
+}
+
+// least squares fit of elapsed = overhead + perPixel * pixels over a mode's
+// runs, -1 until there are runs on at least two image sizes
+int fitCost(const vector<CostSample>& samples, double& overhead, double& perPixel)
+{
+    double n = 0, x = 0, y = 0, xx = 0, xy = 0;
+    for (auto const& sample : samples)
+    {
+        n++;
+        x += sample.pixels;
+        y += sample.elapsed;
+        xx += (double)sample.pixels * sample.pixels;
+        xy += sample.pixels * sample.elapsed;
+    }
+    const double spread = n * xx - x * x;
+    if (n < 2 || spread <= 1e-9 * n * xx)
+        return -1;
+    perPixel = max(0.0, (n * xy - x * y) / spread);
+    overhead = max(0.0, (y - perPixel * x) / n);
+    return 0;
+}
+
+// time a mode on made up images of the probe sizes, so it has a model
+// before it has ever run on a real image. the real image is put back after
+int probeCost(RunState& state, const int mode)
+{
+    Pixel* const pixels = state.pixels;
+    Pixel* const newPixels = state.newPixels;
+    const unsigned long int width = state.width;
+    const unsigned long int height = state.height;
+    const unsigned long int most = COST_PROBE_PIXELS[sizeof(COST_PROBE_PIXELS) / sizeof(COST_PROBE_PIXELS[0]) - 1];
+    state.pixels = (Pixel*)alignedMalloc(most * sizeof(Pixel), PAGE_ALIGNMENT);
+    state.newPixels = (Pixel*)alignedMalloc(most * sizeof(Pixel), PAGE_ALIGNMENT);
+    fillTestImage(state.pixels, most);
+
+    // the probes are learned even when real runs aren't,
+    // the model has nothing else to go by
+    const bool learnCosts = state.learnCosts;
+    int result = 0;
+    for (auto const probe : COST_PROBE_PIXELS)
+    {
+        // one row, the full frame modes don't care about the shape
+        state.width = probe;
+        state.height = 1;
+        double elapsed;
+        // the first run sets up buffers and threads, only the second one counts
+        state.learnCosts = false;
+        result = runMode(mode, state, elapsed);
+        state.learnCosts = true;
+        if (result == -1 || runMode(mode, state, elapsed) == -1)
+        {
+            result = -1;
+            break;
+        }
+    }
+    state.learnCosts = learnCosts;
+
+    alignedFree(state.pixels);
+    alignedFree(state.newPixels);
+    state.pixels = pixels;
+    state.newPixels = newPixels;
+    state.width = width;
+    state.height = height;
+    return result;
+}
+
+// the mode the cost model expects to be fastest on the loaded image
+int chooseMode(RunState& state)
+{
+    if (!state.costsLoaded && !state.costFile.empty())
+    {
+        loadCosts(state);
+        state.costsLoaded = true;
+    }
+    const unsigned long int length = state.width * state.height;
+    int best = MODE_SERIAL;
+    double bestTime = -1;
+    for (auto const mode : AUTO_CANDIDATES)
+    {
+        if (!isAvailable(state, mode))
+            continue;
+        const vector<CostSample>& samples = state.costSamples[make_pair(mode, outputChannels(state))];
+        double overhead, perPixel;
+        if (fitCost(samples, overhead, perPixel) == -1)
+        {
+            if (!state.quiet)
+                cout << "Timing " << MODE_NAMES[mode] << " mode for the cost model..." << endl;
+            if (probeCost(state, mode) == -1 || fitCost(samples, overhead, perPixel) == -1)
+                continue;
+        }
+        const double predicted = overhead + perPixel * length;
+        if (bestTime < 0 || predicted < bestTime)
+        {
+            best = mode;
+            bestTime = predicted;
+        }
+    }
+    if (!state.quiet && best != state.autoChoice)
+        cout << "Auto mode picked " << MODE_NAMES[best] << " (" << bestTime << " ms expected)." << endl;
+    return best;
+}
+
+// run one attempt once and store its elapsed time in ms,
+// full frame modes leave their output in state.newPixels
+// while streaming, luma and transcode modes write state.outName themselves
+int runAttempt(const int mode, RunState& state, double& elapsed)
+{
+    switch (mode)
+    {
+        case MODE_SERIAL:
+        {
+            if (loadImage(state) == -1)
+                return -1;
+            chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+            grayscaleFilterTo(state.pixels, (unsigned char*)state.newPixels, outputChannels(state), state.width * state.height);
+            elapsed = elapsedSince(start);
+            return 0;
+        }
+        case MODE_OPENCL_CPU:
+        {
+            if (state.clDevicesCPU.size() == 0)
+            {
+                cerr << "No available OpenCL CPU device." << endl;
+                return -1;
+            }
+            if (loadImage(state) == -1)
+                return -1;
+            return runOpenCL(selectDevice(state, state.clDevicesCPU), state, elapsed);
+        }
+        case MODE_OPENCL_GPU:
+        {
+            if (state.clDevicesGPU.size() == 0)
+            {
+                cerr << "No available OpenCL GPU device." << endl;
+                return -1;
+            }
+            if (loadImage(state) == -1)
+                return -1;
+            return runOpenCL(selectDevice(state, state.clDevicesGPU), state, elapsed);
+        }
+        case MODE_OPENCL_HYBRID:
+        {
+            if (loadImage(state) == -1)
+                return -1;
+            if (makeHybridWorkers(state, state.hybridSplit) == -1)
+                return -1;
+            return runHybrid(state.hybridSplit, state, elapsed);
+        }
+        case MODE_MULTI:
+        {
+            if (loadImage(state) == -1)
+                return -1;
+            if (makeMultiWorkers(state, state.hybridSplit) == -1)
+                return -1;
+            return runMulti(state.hybridSplit, state, elapsed);
+        }
+        case MODE_STREAM_SERIAL:
+        {
+            BandFilter filter = [](const Pixel* band, Pixel* newBand, const unsigned long int length)
+            {
+                return grayscaleFilter(band, newBand, length);
+            };
+            return runStreaming(filter, state, elapsed);
+        }
+        case MODE_STREAM_OPENCL:
+        {
+            if (state.clDevicesCPU.size() == 0 && state.clDevicesGPU.size() == 0)
+            {
+                cerr << "No available OpenCL device." << endl;
+                return -1;
+            }
+            // on the GPU if there is one
+            DeviceSession* session = getSession(state, selectDevice(state, state.clDevicesGPU.size() > 0 ? state.clDevicesGPU : state.clDevicesCPU));
+            if (session == NULL)
+                return -1;
+            BandFilter filter = [session](const Pixel* band, Pixel* newBand, const unsigned long int length)
+            {
+                return session->run(band, (unsigned char*)newBand, 3, length);
+            };
+            return runStreaming(filter, state, elapsed);
+        }
+        case MODE_HOST_THREADS:
+        {
+            if (loadImage(state) == -1)
+                return -1;
+            if (state.pool.size() != state.threadCount)
+                state.pool.start(state.threadCount, state.pinThreads);
+            chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+            grayscaleFilterParallel(state.pool, state.pixels, (unsigned char*)state.newPixels, outputChannels(state), state.width * state.height);
+            elapsed = elapsedSince(start);
+            return 0;
+        }
+        case MODE_LUMA:
+            return runLuma(state, elapsed);
+        case MODE_TRANSCODE:
+            return runTranscode(state, elapsed);
+        case MODE_AUTO:
+        {
+            if (loadImage(state) == -1)
+                return -1;
+            state.autoChoice = chooseMode(state);
+            return runMode(state.autoChoice, state, elapsed);
+        }
+    }
+    return -1;
+}
+
+// runAttempt, logging the runs of the modes the auto mode picks from
+int runMode(const int mode, RunState& state, double& elapsed)
+{
+    // the streaming pipeline encodes rgb bands, whichever way the mode was picked
+    if (state.grayOutput && isStreamingMode(mode))
+    {
+        cerr << "Streaming modes write RGB images only." << endl;
+        return -1;
+    }
+    state.profiled.clear();
+    const int result = runAttempt(mode, state, elapsed);
+    if (result == 0 && state.learnCosts && isCostModeled(mode))
+        recordCost(state, mode, state.width * state.height, elapsed);
+    return result;
+}
+
+// how well the host threads mode scales compared to one thread, 1 is perfect
+double scalingEfficiency(RunState& state, const double elapsed)
+{
+    if (state.serialReference < 0)
+    {
+        // best of a few single threaded runs
+        for (int i = 0; i < 3; ++i)
+        {
+            chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+            grayscaleFilterTo(state.pixels, (unsigned char*)state.newPixels, outputChannels(state), state.width * state.height);
+            const double time = elapsedSince(start);
+            if (state.serialReference < 0 || time < state.serialReference)
+                state.serialReference = time;
+        }
+    }
+    return elapsed > 0 ? state.serialReference / elapsed / state.threadCount : 0;
+}
+
+bool isStreamingMode(const int mode)
+{
+    return mode == MODE_STREAM_SERIAL || mode == MODE_STREAM_OPENCL;
+}
+
+// modes that go from file to file without a full frame in state
+bool isFileMode(const int mode)
+{
+    return isStreamingMode(mode) || mode == MODE_LUMA || mode == MODE_TRANSCODE;
+}
@@ -0,0 +1,915 @@
+// the grayscale engine behind the program and the library:
+// filters, jpeg i/o, OpenCL sessions and the modes that combine them
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <functional>
+#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+extern "C"
+{
+    #include "lib/jpeglib.h"
+}
+#ifdef __APPLE__
+    #include <OpenCL/cl.h>
+#else
+    #include <CL/cl.h>
+#endif
+#include "cl.hpp"
+
+using namespace std;
+
+struct Pixel
+{
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+};
+
+// the pixel buffers are handed to libjpeg and SIMD code as packed rgb bytes
+static_assert(sizeof(Pixel) == 3, "Pixel must be tightly packed");
+
+// instruction sets grayscaleFilter can use, in order of preference
+enum SimdLevel
+{
+    SIMD_SCALAR = 0,
+    SIMD_SSE41,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_COUNT
+};
+
+const char* const SIMD_NAMES[SIMD_COUNT] = { "scalar", "sse4.1", "avx2", "avx512" };
+
+// number of scanlines the streaming pipeline keeps in memory at once
+const unsigned long int STREAM_BAND_ROWS = 64;
+
+// filters one band of pixels for the streaming pipeline
+typedef function<int(const Pixel*, Pixel*, const unsigned long int)> BandFilter;
+
+// the widest instruction set the host and the OS support
+SimdLevel detectSimdLevel();
+// what grayscaleFilter uses, the host's best unless asked otherwise
+extern SimdLevel simdLevel;
+
+int grayscaleFilterTo(const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length);
+int grayscaleFilter(const Pixel* pixels, Pixel*& newPixels, const unsigned long int length);
+
+void* alignedMalloc(const size_t size, const size_t alignment);
+void alignedFree(void* ptr);
+
+// image buffers start on a page, so OpenCL devices that share host memory
+// can work on them in place (see ZeroCopy)
+const size_t PAGE_ALIGNMENT = 4096;
+
+// a pixel count cut to whole pages of pixels, down or up, so every run of
+// pixels starting at such a count in a page aligned image stays page aligned
+inline unsigned long int roundToPages(const unsigned long int pixels, const bool up = false)
+{
+    return (up ? pixels + PAGE_ALIGNMENT - 1 : pixels) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+}
+
+// a fixed set of worker threads that are reused for every run,
+// run() hands each worker its index and waits for all of them
+class ThreadPool
+{
+public:
+    ThreadPool() : task(NULL), generation(0), pending(0), stopping(false) {}
+
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    // start count workers, optionally pinning worker i to core i
+    void start(const unsigned int count, const bool pin)
+    {
+        stop();
+        stopping = false;
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            // workers of a restarted pool only pick up runs from here on
+            workers.push_back(thread(&ThreadPool::work, this, i, generation));
+            if (pin)
+                pinWorker(i);
+        }
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    unsigned int size() const
+    {
+        return (unsigned int)workers.size();
+    }
+
+    void run(const function<void(const unsigned int)>& task)
+    {
+        unique_lock<mutex> guard(lock);
+        this->task = &task;
+        pending = size();
+        generation++;
+        wake.notify_all();
+        done.wait(guard, [this] { return pending == 0; });
+        this->task = NULL;
+    }
+
+private:
+    void work(const unsigned int index, unsigned long int seen)
+    {
+        while (true)
+        {
+            const function<void(const unsigned int)>* current;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                current = task;
+            }
+            (*current)(index);
+            {
+                lock_guard<mutex> guard(lock);
+                if (--pending == 0)
+                    done.notify_one();
+            }
+        }
+    }
+
+    void pinWorker(const unsigned int index);
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(const unsigned int)>* task;
+    // bumped for every run so workers can tell a new task from a spurious wakeup
+    unsigned long int generation;
+    unsigned int pending;
+    bool stopping;
+};
+
+// 64 pixels are 192 bytes, three whole cache lines,
+// or a single one for gray output, so threads never share a line of output
+const unsigned long int PARALLEL_CHUNK_ALIGNMENT = 64;
+
+int grayscaleFilterParallel(ThreadPool& pool, const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length);
+
+// jpeg files and buffers, the decoders malloc their output and the encoders
+// their jpeg, both are released with free()
+int readImageInfo(const char* name, unsigned long int& width, unsigned long int& height);
+int decodeImage(const unsigned char* data, const size_t size, struct Pixel*& pixels, unsigned long int& width, unsigned long int& height);
+int readImage(const char* name, struct Pixel*& pixels, unsigned long int& width, unsigned long int& height);
+int encodeImage(const struct Pixel* pixels, const unsigned long int width, const unsigned long int height, unsigned char*& jpeg, unsigned long int& size);
+int encodeGrayImage(const unsigned char* gray, const unsigned long int width, const unsigned long int height, unsigned char*& jpeg, unsigned long int& size);
+int writeImage(const char* name, const struct Pixel* pixels, const unsigned long int width, const unsigned long int height);
+int writeGrayImage(const char* name, const unsigned char* gray, const unsigned long int width, const unsigned long int height);
+int decodeGrayImage(const unsigned char* data, const size_t size, unsigned char*& gray, unsigned long int& width, unsigned long int& height);
+int readGrayImage(const char* name, unsigned char*& gray, unsigned long int& width, unsigned long int& height);
+int transcodeGrayImage(const char* inName, const char* outName, unsigned long int& width, unsigned long int& height);
+int streamImage(const char* inName, const char* outName, const unsigned long int bandRows, const BandFilter& filter, unsigned long int& width, unsigned long int& height);
+
+int makeDirectory(const string& path);
+int buildProgram(const cl::Context& context, const cl::Device& device, const cl::Program::Sources& sources, const string& cacheDir, cl::Program& program);
+
+// the commands one session run is made of
+enum Phase
+{
+    PHASE_UPLOAD = 0,
+    PHASE_KERNEL,
+    PHASE_READBACK,
+    PHASE_COUNT
+};
+
+const char* const PHASE_NAMES[PHASE_COUNT] = { "upload", "kernel", "readback" };
+
+// device timestamps of one command, in ns
+struct CommandTimes
+{
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+};
+
+// where a session's time went since the last resetProfile()
+struct SessionProfile
+{
+    // the commands of the first run, to show its timeline
+    CommandTimes first[PHASE_COUNT];
+    // summed time each phase spent executing (start to end)
+    // and waiting in the queue (queued to start), in ms
+    double busy[PHASE_COUNT];
+    double waiting[PHASE_COUNT];
+    unsigned long int runs;
+    // strips the runs were split into, the same as runs unless tiled
+    unsigned long int strips;
+};
+
+// whether sessions wrap the host's pixel buffers (CL_MEM_USE_HOST_PTR)
+// instead of copying them into device buffers and back,
+// auto does it on devices that share memory with the host
+enum ZeroCopy
+{
+    ZERO_COPY_AUTO = 0,
+    ZERO_COPY_ON,
+    ZERO_COPY_OFF,
+    ZERO_COPY_COUNT
+};
+
+const char* const ZERO_COPY_NAMES[ZERO_COPY_COUNT] = { "auto", "on", "off" };
+
+// the kernels of main.cl a session can filter with: one pixel per work-item,
+// 4, 8 or 16 per work-item through vector loads, or a fixed grid of work-items
+// striding over groups of 16. auto goes by the device's preferred char vector width
+enum KernelVariant
+{
+    KERNEL_AUTO = 0,
+    KERNEL_X1,
+    KERNEL_X4,
+    KERNEL_X8,
+    KERNEL_X16,
+    KERNEL_STRIDE,
+    KERNEL_VARIANT_COUNT
+};
+
+const char* const KERNEL_NAMES[KERNEL_VARIANT_COUNT] = { "auto", "x1", "x4", "x8", "x16", "stride" };
+// suffix of the kernel functions in main.cl
+const char* const KERNEL_SUFFIXES[KERNEL_VARIANT_COUNT] = { "", "", "X4", "X8", "X16", "Stride" };
+const unsigned long int KERNEL_PIXELS[KERNEL_VARIANT_COUNT] = { 0, 1, 4, 8, 16, 16 };
+
+// work-items per compute unit of the stride kernel's grid
+const unsigned long int STRIDE_ITEMS_PER_UNIT = 256;
+
+// how a session launches one of its kernels
+struct KernelConfig
+{
+    KernelVariant variant;
+    // work-group size, 0 leaves it to the driver
+    unsigned long int local;
+};
+
+// a queue and the buffers one strip of an image is filtered with
+struct StripSlot
+{
+    cl::CommandQueue queue;
+    cl::Buffer in;
+    cl::Buffer out;
+    // how many pixels the input buffer and how many bytes the output buffer can hold
+    unsigned long int capacity;
+    unsigned long int outCapacity;
+};
+
+// strips of an image in flight at once, each on its own queue, so one can
+// upload while the next is in the kernel and the one after reads back
+const int STRIP_SLOTS = 3;
+
+// a copying session splits an image into strips of at least this many
+// pixels, at most OVERLAP_MAX_CHUNKS of them, to overlap their transfers
+const unsigned long int OVERLAP_MIN_PIXELS = 1 << 18;
+const unsigned long int OVERLAP_MAX_CHUNKS = 8;
+
+// one context over every CPU and GPU device of a platform, so the sessions
+// of those devices can work on regions of the same buffers (see
+// DeviceSession::runRegion). each session still builds the program for
+// its own device, when it is first used
+struct PlatformContext
+{
+    cl::Context context;
+    // false when it couldn't be set up, the sessions then get their own
+    bool ready;
+};
+
+// a long-lived OpenCL setup for one device,
+// the program is built once and the buffers only grow
+// when a bigger image than before comes along
+class DeviceSession
+{
+public:
+    DeviceSession() : zeroCopy(false), strideItems(0), maxAlloc(0), globalMem(0), tilePixels(0), overlapChunks(1), initialized(false),
+        hasPending(false)
+    {
+        resetProfile();
+    }
+
+    // shared is the device's platform context, NULL for a context of its own
+    int init(const cl::Device& device, const cl::Program::Sources& sources, const string& cacheDir, const ZeroCopy zeroCopyMode,
+        const KernelVariant kernelVariant, const PlatformContext* shared)
+    {
+        this->device = device;
+        cl_int err;
+        zeroCopy = zeroCopyMode == ZERO_COPY_ON
+            || (zeroCopyMode == ZERO_COPY_AUTO && device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE);
+        if (shared != NULL)
+            context = shared->context;
+        else
+        {
+            context = cl::Context(device, NULL, NULL, NULL, &err);
+            if (err != CL_SUCCESS)
+                return -1;
+        }
+        if (buildProgram(context, device, sources, cacheDir, program) == -1)
+            return -1;
+        for (int v = KERNEL_X1; v < KERNEL_VARIANT_COUNT; ++v)
+        {
+            kernels[v] = cl::Kernel(program, (string("grayscale") + KERNEL_SUFFIXES[v]).c_str(), &err);
+            if (err != CL_SUCCESS)
+                return -1;
+            grayKernels[v] = cl::Kernel(program, (string("grayscaleGray") + KERNEL_SUFFIXES[v]).c_str(), &err);
+            if (err != CL_SUCCESS)
+                return -1;
+        }
+        KernelConfig config = { kernelVariant, 0 };
+        if (config.variant == KERNEL_AUTO)
+        {
+            const cl_uint width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();
+            config.variant = width >= 16 ? KERNEL_X16 : (width >= 8 ? KERNEL_X8 : KERNEL_X4);
+        }
+        configs[0] = config;
+        configs[1] = config;
+        configured[0] = false;
+        configured[1] = false;
+        strideItems = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * STRIDE_ITEMS_PER_UNIT;
+        for (int i = 0; i < STRIP_SLOTS; ++i)
+        {
+            slots[i].queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+            if (err != CL_SUCCESS)
+                return -1;
+            slots[i].capacity = 0;
+            slots[i].outCapacity = 0;
+        }
+        maxAlloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        globalMem = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        initialized = true;
+        return 0;
+    }
+
+    // filter images bigger than pixels in strips, on top of the device limits
+    void limitTile(const unsigned long int pixels)
+    {
+        tilePixels = tilePixels > 0 ? min(tilePixels, pixels) : pixels;
+    }
+
+    // most pixels filtered in one strip with channels bytes per output pixel:
+    // a strip's input has to fit one allocation, and unless the session works
+    // in place, the buffers of every slot half the global memory, the rest is
+    // left to whoever else uses the device. whole pages of pixels
+    unsigned long int getTilePixels(const int channels) const
+    {
+        unsigned long int pixels = maxAlloc / sizeof(Pixel);
+        if (!zeroCopy)
+            pixels = min(pixels, (unsigned long int)(globalMem / 2 / (STRIP_SLOTS * (sizeof(Pixel) + channels))));
+        if (tilePixels > 0)
+            pixels = min(pixels, tilePixels);
+        return max(roundToPages(pixels), (unsigned long int)PAGE_ALIGNMENT);
+    }
+
+    // strips to split every image into, 0 picks them by the image's size
+    // (see stripPixels), 1 only splits what doesn't fit the tile
+    void setOverlap(const unsigned long int chunks)
+    {
+        overlapChunks = chunks;
+    }
+
+    bool ready() const
+    {
+        return initialized;
+    }
+
+    const cl::Device& getDevice() const
+    {
+        return device;
+    }
+
+    const cl::Context& getContext() const
+    {
+        return context;
+    }
+
+    bool usesZeroCopy() const
+    {
+        return zeroCopy;
+    }
+
+    // how the kernel for channels bytes per output pixel is launched
+    const KernelConfig& getConfig(const int channels) const
+    {
+        return configs[channels == 1];
+    }
+
+    // whether the launch config for channels has been tuned or looked up yet
+    bool isConfigured(const int channels) const
+    {
+        return configured[channels == 1];
+    }
+
+    void markConfigured(const int channels)
+    {
+        configured[channels == 1] = true;
+    }
+
+    // -1 if the device can't run the variant with that work-group size
+    int setConfig(const int channels, const KernelConfig& config)
+    {
+        if (config.variant <= KERNEL_AUTO || config.variant >= KERNEL_VARIANT_COUNT)
+            return -1;
+        const vector<unsigned long int> sizes = localSizes(config.variant, channels);
+        if (config.local > sizes.back())
+            return -1;
+        configs[channels == 1] = config;
+        return 0;
+    }
+
+    // work-group sizes worth trying for a variant: the driver's choice (0) and
+    // the preferred multiple times powers of two, up to what the kernel allows
+    vector<unsigned long int> localSizes(const KernelVariant variant, const int channels) const
+    {
+        const cl::Kernel& filter = (channels == 1 ? grayKernels : kernels)[variant];
+        const unsigned long int multiple = filter.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+        const unsigned long int most = min((unsigned long int)filter.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+            (unsigned long int)device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>()[0]);
+        vector<unsigned long int> sizes(1, 0);
+        for (unsigned long int size = max(multiple, 1ul); size <= most; size *= 2)
+            sizes.push_back(size);
+        return sizes;
+    }
+
+    // upload, filter and read back length pixels without waiting,
+    // out gets channels bytes per pixel (3 for RGB, 1 for gray),
+    // both pointers have to stay valid until finish() returns
+    // and only one enqueue can be in flight at a time
+    int enqueue(const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+    {
+        pending.clear();
+        tails.clear();
+        hasPending = true;
+        // the image is filtered in strips taking turns on the slots, so the
+        // uploads, kernels and readbacks of different strips run at the same
+        // time, and each strip's output lands in its place in out
+        const unsigned long int strip = stripPixels(length, channels);
+        for (unsigned long int begin = 0, index = 0; begin < length; begin += strip, ++index)
+        {
+            const unsigned long int size = min(strip, length - begin);
+            if (enqueueStrip(slots[index % STRIP_SLOTS], pixels + begin, out + begin * channels, channels, size) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    int finish()
+    {
+        bool failed = false;
+        for (int i = 0; i < STRIP_SLOTS; ++i)
+            failed = slots[i].queue.finish() != CL_SUCCESS || failed;
+        if (failed)
+        {
+            hasPending = false;
+            return -1;
+        }
+        if (hasPending)
+            collectProfile();
+        return 0;
+    }
+
+    int run(const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+    {
+        if (enqueue(pixels, out, channels, length) == -1)
+        {
+            hasPending = false;
+            finish();
+            return -1;
+        }
+        return finish();
+    }
+
+    // filter the length pixels at begin of in into out, two buffers of the
+    // session's context that other sessions work on too. the kernel runs on
+    // sub-buffers of the region, so the runtime only moves that region to
+    // the device and back and nothing is staged on the host. begin has to
+    // keep both regions on the device's base address alignment
+    int runRegion(cl::Buffer& in, cl::Buffer& out, const unsigned long int begin, const unsigned long int length,
+        const int channels)
+    {
+        pending.clear();
+        tails.clear();
+        pending.resize(PHASE_COUNT);
+        hasPending = true;
+        StripSlot& slot = slots[0];
+        cl_int err;
+        cl_buffer_region inRegion = { begin * sizeof(Pixel), length * sizeof(Pixel) };
+        cl_buffer_region outRegion = { begin * channels, length * channels };
+        cl::Buffer inPart = in.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &inRegion, &err);
+        bool failed = err != CL_SUCCESS;
+        cl::Buffer outPart;
+        if (!failed)
+        {
+            outPart = out.createSubBuffer(CL_MEM_WRITE_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &outRegion, &err);
+            failed = err != CL_SUCCESS;
+        }
+        // the upload happens when the kernel needs the region, the marker keeps the phase breakdown complete
+        failed = failed || slot.queue.enqueueMarkerWithWaitList(NULL, &pending[PHASE_UPLOAD]) != CL_SUCCESS;
+        failed = failed || launch(slot.queue, inPart, outPart, channels, length, &pending[PHASE_KERNEL]) == -1;
+        if (!failed)
+        {
+            void* mapped = slot.queue.enqueueMapBuffer(outPart, CL_FALSE, CL_MAP_READ, 0, length * channels, NULL, &pending[PHASE_READBACK],
+                &err);
+            failed = err != CL_SUCCESS || slot.queue.enqueueUnmapMemObject(outPart, mapped) != CL_SUCCESS;
+        }
+        if (failed)
+            hasPending = false;
+        return finish() == -1 || failed ? -1 : 0;
+    }
+
+    void resetProfile()
+    {
+        profile = SessionProfile();
+    }
+
+    const SessionProfile& getProfile() const
+    {
+        return profile;
+    }
+
+private:
+    // pixels per strip of an image of length pixels: whole pages, no more than
+    // the tile, and the image split into overlapChunks strips. auto splits
+    // only when the session copies, into strips of at least OVERLAP_MIN_PIXELS
+    unsigned long int stripPixels(const unsigned long int length, const int channels) const
+    {
+        unsigned long int chunks = overlapChunks;
+        if (chunks == 0)
+            chunks = zeroCopy ? 1 : max(1ul, min(OVERLAP_MAX_CHUNKS, length / OVERLAP_MIN_PIXELS));
+        return min(getTilePixels(channels), roundToPages((length + chunks - 1) / chunks, true));
+    }
+
+    // upload, filter and read back one strip on a slot's queue,
+    // its commands' events go to the end of pending
+    int enqueueStrip(StripSlot& slot, const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length)
+    {
+        pending.resize(pending.size() + PHASE_COUNT);
+        cl::Event* events = &pending[pending.size() - PHASE_COUNT];
+        if (zeroCopy)
+            return enqueueInPlace(slot, pixels, out, channels, length, events);
+        if (reserve(slot, length, channels * length) == -1)
+            return -1;
+        if (slot.queue.enqueueWriteBuffer(slot.in, CL_FALSE, 0, sizeof(Pixel) * length, pixels, NULL, &events[PHASE_UPLOAD]) != CL_SUCCESS)
+            return -1;
+        if (launch(slot.queue, slot.in, slot.out, channels, length, &events[PHASE_KERNEL]) == -1)
+            return -1;
+        if (slot.queue.enqueueReadBuffer(slot.out, CL_FALSE, 0, channels * length, out, NULL, &events[PHASE_READBACK]) != CL_SUCCESS)
+            return -1;
+        return 0;
+    }
+
+    // the kernel works on pixels and out themselves, which is free on devices
+    // that share host memory and page aligned buffers. the buffers are made
+    // for every strip, since the pointers change from run to run, and
+    // replacing the slot's last ones is fine as OpenCL keeps them alive
+    // until the commands that use them are done
+    int enqueueInPlace(StripSlot& slot, const Pixel* pixels, unsigned char* out, const int channels, const unsigned long int length,
+        cl::Event* events)
+    {
+        cl_int err;
+        slot.in = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(Pixel) * length, (void*)pixels, &err);
+        if (err != CL_SUCCESS)
+            return -1;
+        slot.out = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, channels * length, out, &err);
+        if (err != CL_SUCCESS)
+            return -1;
+        // the copy path's buffers are gone, reserve() has to make new ones
+        slot.capacity = 0;
+        slot.outCapacity = 0;
+        // nothing to upload, the marker keeps the phase breakdown complete
+        if (slot.queue.enqueueMarkerWithWaitList(NULL, &events[PHASE_UPLOAD]) != CL_SUCCESS)
+            return -1;
+        if (launch(slot.queue, slot.in, slot.out, channels, length, &events[PHASE_KERNEL]) == -1)
+            return -1;
+        // mapping is what makes the kernel's writes visible in out,
+        // without a copy when the device shares host memory
+        void* mapped = slot.queue.enqueueMapBuffer(slot.out, CL_FALSE, CL_MAP_READ, 0, channels * length, NULL, &events[PHASE_READBACK], &err);
+        if (err != CL_SUCCESS)
+            return -1;
+        if (slot.queue.enqueueUnmapMemObject(slot.out, mapped) != CL_SUCCESS)
+            return -1;
+        return 0;
+    }
+
+    // filter length pixels of in into out with the session's launch config,
+    // the last pixels that don't fill a work-item go through the one pixel
+    // kernel at a global offset, and the work-items that don't fill a
+    // work-group run in a launch of their own. the main launch is the profiled one
+    int launch(cl::CommandQueue& queue, const cl::Buffer& in, const cl::Buffer& out, const int channels, const unsigned long int length,
+        cl::Event* event)
+    {
+        const KernelConfig& config = configs[channels == 1];
+        cl::Kernel* filters = channels == 1 ? grayKernels : kernels;
+        const unsigned long int groups = length / KERNEL_PIXELS[config.variant];
+        const int used = groups > 0 ? config.variant : KERNEL_X1;
+        const unsigned long int done = used == KERNEL_X1 ? length : groups * KERNEL_PIXELS[used];
+        filters[used].setArg(0, in);
+        filters[used].setArg(1, out);
+        if (done < length)
+        {
+            filters[KERNEL_X1].setArg(0, in);
+            filters[KERNEL_X1].setArg(1, out);
+            tails.push_back(cl::Event());
+            if (queue.enqueueNDRangeKernel(filters[KERNEL_X1], cl::NDRange(done), cl::NDRange(length - done), cl::NullRange, NULL,
+                    &tails.back()) != CL_SUCCESS)
+                return -1;
+        }
+        unsigned long int items = used == KERNEL_X1 ? length : groups;
+        if (used == KERNEL_STRIDE)
+        {
+            filters[used].setArg(2, (cl_ulong)groups);
+            items = min(groups, strideItems);
+        }
+        const unsigned long int local = used == config.variant && config.local > 0 && items >= config.local ? config.local : 0;
+        const unsigned long int whole = local > 0 ? items / local * local : items;
+        // the stride grid just shrinks to whole work-groups, it covers every group anyway
+        if (used == KERNEL_STRIDE)
+            items = whole;
+        if (whole < items)
+        {
+            tails.push_back(cl::Event());
+            if (queue.enqueueNDRangeKernel(filters[used], cl::NDRange(whole), cl::NDRange(items - whole), cl::NullRange, NULL, &tails.back())
+                != CL_SUCCESS)
+                return -1;
+        }
+        return queue.enqueueNDRangeKernel(filters[used], cl::NullRange, cl::NDRange(whole), local > 0 ? cl::NDRange(local) : cl::NullRange,
+            NULL, event) == CL_SUCCESS ? 0 : -1;
+    }
+
+    // make sure a slot's buffers can hold length pixels in and outBytes out
+    int reserve(StripSlot& slot, const unsigned long int length, const unsigned long int outBytes)
+    {
+        cl_int err;
+        if (length > slot.capacity)
+        {
+            slot.in = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, sizeof(Pixel) * length, NULL, &err);
+            if (err != CL_SUCCESS)
+                return -1;
+            slot.capacity = length;
+        }
+        if (outBytes > slot.outCapacity)
+        {
+            slot.out = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, outBytes, NULL, &err);
+            if (err != CL_SUCCESS)
+                return -1;
+            slot.outCapacity = outBytes;
+        }
+        return 0;
+    }
+
+    // add the finished commands of the last enqueue to the profile,
+    // the first strip's commands stand for the timeline
+    void collectProfile()
+    {
+        hasPending = false;
+        for (size_t strip = 0; strip < pending.size() / PHASE_COUNT; ++strip)
+        {
+            for (int phase = 0; phase < PHASE_COUNT; ++phase)
+            {
+                const cl::Event& event = pending[strip * PHASE_COUNT + phase];
+                CommandTimes times;
+                event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &times.queued);
+                event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &times.submit);
+                event.getProfilingInfo(CL_PROFILING_COMMAND_START, &times.start);
+                event.getProfilingInfo(CL_PROFILING_COMMAND_END, &times.end);
+                if (profile.runs == 0 && strip == 0)
+                    profile.first[phase] = times;
+                profile.busy[phase] += (times.end - times.start) / 1000000.0;
+                profile.waiting[phase] += (times.start - times.queued) / 1000000.0;
+            }
+            profile.strips++;
+        }
+        for (const cl::Event& event : tails)
+        {
+            cl_ulong start;
+            cl_ulong end;
+            event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+            event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+            profile.busy[PHASE_KERNEL] += (end - start) / 1000000.0;
+        }
+        tails.clear();
+        profile.runs++;
+    }
+
+    cl::Device device;
+    cl::Context context;
+    cl::Program program;
+    // one kernel per variant, and the same with one byte per pixel out
+    cl::Kernel kernels[KERNEL_VARIANT_COUNT];
+    cl::Kernel grayKernels[KERNEL_VARIANT_COUNT];
+    StripSlot slots[STRIP_SLOTS];
+    // the slots' buffers wrap the host's (see enqueueInPlace)
+    bool zeroCopy;
+    // launch configs for rgb (0) and gray (1) output
+    KernelConfig configs[2];
+    bool configured[2];
+    // work-items of the stride kernel
+    unsigned long int strideItems;
+    // device limits on what the strips' buffers can take, in bytes
+    cl_ulong maxAlloc;
+    cl_ulong globalMem;
+    // most pixels filtered in one strip as asked for, 0 for the device limits alone
+    unsigned long int tilePixels;
+    // strips every image is split into, 0 for auto
+    unsigned long int overlapChunks;
+    bool initialized;
+    // events of the enqueue that hasn't been collected yet, PHASE_COUNT per strip
+    vector<cl::Event> pending;
+    // the launches for the pixels the main one leaves over, part of the kernel phase
+    vector<cl::Event> tails;
+    bool hasPending;
+    SessionProfile profile;
+};
+
+// attempts that can be picked from the menu or the command line
+enum Mode
+{
+    MODE_EXIT = 0,
+    MODE_SERIAL,
+    MODE_OPENCL_CPU,
+    MODE_OPENCL_GPU,
+    MODE_OPENCL_HYBRID,
+    MODE_STREAM_SERIAL,
+    MODE_STREAM_OPENCL,
+    MODE_HOST_THREADS,
+    MODE_LUMA,
+    MODE_TRANSCODE,
+    MODE_MULTI,
+    MODE_AUTO,
+    MODE_COUNT
+};
+
+// names used on the command line and in reports
+const char* const MODE_NAMES[MODE_COUNT] = { "exit", "serial", "cpu", "gpu", "hybrid", "stream", "stream-cl", "threads", "luma", "transcode", "multi", "auto" };
+// names used in the menu and the elapsed time output
+const char* const MODE_TITLES[MODE_COUNT] = { "Exit program", "Serial", "OpenCL CPU", "OpenCL GPU", "Hybrid", "Streaming serial", "Streaming OpenCL", "Host threads", "Luma", "Luma transcode",
+    "All OpenCL devices", "Automatic" };
+
+// the hybrid mode splits the image into about this many chunks,
+// unless that makes them smaller than the minimum
+const unsigned long int HYBRID_CHUNKS = 64;
+const unsigned long int HYBRID_MIN_CHUNK = 65536;
+
+// one participant of the hybrid mode
+struct HybridWorker
+{
+    string name;
+    // NULL for a plain host thread
+    DeviceSession* session;
+    unsigned long int pixelsDone;
+    unsigned long int chunksDone;
+    // time spent filtering in the last run, in ms
+    double busy;
+    // the image's buffers when the devices of the run share a context,
+    // null buffers otherwise (see shareBuffers), and for a host thread
+    // the queue it maps its chunks of them with
+    cl::Buffer in;
+    cl::Buffer out;
+    cl::CommandQueue queue;
+};
+
+// how fast a device filtered the calibration image, see calibrateDevice
+struct DeviceScore
+{
+    // whole runs: upload, kernel and readback
+    double pixelsPerSec;
+    // the kernel alone
+    double kernelPixelsPerSec;
+    // uploads and readbacks in GB/s, 0 when nothing is copied
+    double bandwidth;
+    // measured by this process rather than read from the scores file
+    bool fresh;
+};
+
+// one timed run of a full frame mode, what the auto mode's cost model learns from
+struct CostSample
+{
+    unsigned long int pixels;
+    double elapsed;
+};
+
+// everything a mode needs to run on one image
+struct RunState
+{
+    const char* inName;
+    const char* outName;
+    // the original image pixels, only decoded once a mode needs the full frame
+    struct Pixel* pixels;
+    // the filtered pixels of the last full frame run,
+    // one byte per pixel when grayOutput is set
+    struct Pixel* newPixels;
+    bool grayOutput;
+    unsigned long int width;
+    unsigned long int height;
+    vector<cl::Device> clDevicesCPU;
+    vector<cl::Device> clDevicesGPU;
+    string clSrc;
+    cl::Program::Sources sources;
+    // where built OpenCL programs are cached, empty for no caching
+    string cacheDir;
+    ZeroCopy zeroCopy;
+    KernelVariant kernelVariant;
+    // most pixels a session filters in one strip, 0 for the device limits,
+    // and strips every image is split into, 0 to split by size on devices
+    // where that measures faster (see measureOverlap)
+    unsigned long int tilePixels;
+    unsigned long int overlapChunks;
+    // where tuned launch configs are kept, empty for no tuning,
+    // and the configs by device and kernel once the file is read
+    string tuneFile;
+    bool retune;
+    map<string, KernelConfig> tuning;
+    bool tuningLoaded;
+    // where device scores are kept and the scores by device once the file is read,
+    // recalibrate measures every device again
+    string scoreFile;
+    bool recalibrate;
+    map<string, DeviceScore> deviceScores;
+    bool scoresLoaded;
+    // where the runs of each full frame mode are logged, empty for nowhere,
+    // the latest of them by mode and output channels once the file is read, whether runs are
+    // learned at all, the runs not written to the file yet (see flushCosts)
+    // and the mode the auto mode picked last
+    string costFile;
+    map<pair<int, int>, vector<CostSample> > costSamples;
+    bool costsLoaded;
+    bool learnCosts;
+    string costLog;
+    unsigned long int costLogRuns;
+    int autoChoice;
+    // one session per device, kept warm across runs,
+    // on the context of its platform when it has more than one device
+    map<cl_device_id, DeviceSession> sessions;
+    map<cl_platform_id, PlatformContext> platformContexts;
+    // workers for the host threads mode, started on first use
+    ThreadPool pool;
+    unsigned int threadCount;
+    bool pinThreads;
+    // single threaded time to compare the host threads mode against, in ms
+    double serialReference;
+    // hybrid mode workers (see makeHybridWorkers), chunk size in pixels
+    // and how the last run split the image between the workers
+    string hybridWorkers;
+    unsigned long int hybridChunk;
+    vector<HybridWorker> hybridSplit;
+    // pixels per ms each device managed in its last multi mode run,
+    // what the next run splits the image by
+    map<cl_device_id, double> deviceSpeeds;
+    // sessions used by the last run, for the phase breakdown
+    vector<DeviceSession*> profiled;
+    // host side decode and encode time of the full frame, in ms, -1 if unknown
+    double decodeTime;
+    double encodeTime;
+    // keep the output clean for machine readable reports
+    bool quiet;
+
+    RunState() : inName(NULL), outName("out.jpg"), pixels(NULL), newPixels(NULL), grayOutput(false), width(0), height(0),
+        cacheDir("clcache"), zeroCopy(ZERO_COPY_AUTO), kernelVariant(KERNEL_AUTO), tilePixels(0), overlapChunks(1),
+        tuneFile("cltune.txt"), retune(false), tuningLoaded(false), scoreFile("clscores.txt"), recalibrate(false), scoresLoaded(false),
+        costFile("clcosts.txt"), costsLoaded(false), learnCosts(true), costLogRuns(0), autoChoice(MODE_EXIT),
+        threadCount(max(1u, thread::hardware_concurrency())), pinThreads(false), serialReference(-1), hybridChunk(0),
+        decodeTime(-1), encodeTime(-1), quiet(false) {}
+};
+
+double elapsedSince(const chrono::high_resolution_clock::time_point& start);
+int loadDevices(RunState& state, const char* kernelFile);
+int loadImage(RunState& state);
+int outputChannels(const RunState& state);
+int saveImage(RunState& state);
+DeviceSession* getSession(RunState& state, const cl::Device& device);
+const DeviceScore& getDeviceScore(RunState& state, const cl::Device& device);
+cl::Device selectDevice(RunState& state, const vector<cl::Device>& devices);
+void printProfile(ostream& out, const RunState& state);
+void printHybridSplit(ostream& out, const vector<HybridWorker>& workers);
+int runMode(const int mode, RunState& state, double& elapsed);
+void flushCosts(RunState& state);
+double scalingEfficiency(RunState& state, const double elapsed);
+bool isStreamingMode(const int mode);
+bool isFileMode(const int mode);
+
+#endif // ENGINE_H
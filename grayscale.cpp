@@ -0,0 +1,165 @@
+#include "grayscale.h"
+#include "engine.h"
+
+#include <cstdlib>
+#include <cstring>
+
+// what the library keeps between process() calls
+struct Library
+{
+    Library() : kernelFile("main.cl"), loaded(false)
+    {
+        // a library has no business printing progress,
+        // or writing files nobody asked for (see setCostFile)
+        state.quiet = true;
+        state.costFile.clear();
+        state.learnCosts = false;
+        state.tuneFile.clear();
+        state.scoreFile.clear();
+    }
+
+    ~Library()
+    {
+        flushCosts(state);
+    }
+
+    RunState state;
+    string kernelFile;
+    // devices are looked up and the kernels read on the first call
+    bool loaded;
+    // the sessions and the thread pool serve one call at a time
+    mutex lock;
+    // contiguous copy of inputs with padded rows
+    vector<Pixel> packed;
+};
+
+Library& library()
+{
+    static Library instance;
+    return instance;
+}
+
+void setKernelFile(const char* path)
+{
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    lib.kernelFile = path;
+}
+
+void setProgramCache(const char* dir)
+{
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    lib.state.cacheDir = dir;
+}
+
+void setScoreFile(const char* path)
+{
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    lib.state.scoreFile = path != NULL ? path : "";
+    lib.state.deviceScores.clear();
+    lib.state.scoresLoaded = false;
+}
+
+void setTuneFile(const char* path)
+{
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    lib.state.tuneFile = path != NULL ? path : "";
+    lib.state.tuning.clear();
+    lib.state.tuningLoaded = false;
+}
+
+void setCostFile(const char* path)
+{
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    flushCosts(lib.state);
+    lib.state.costFile = path != NULL ? path : "";
+    lib.state.learnCosts = path != NULL;
+    // the runs of the old file are no longer what the model goes by
+    lib.state.costSamples.clear();
+    lib.state.costsLoaded = false;
+}
+
+int process(const uint8_t* rgb, size_t width, size_t height, size_t stride, uint8_t* out, int mode, int channels)
+{
+    // the engine's mode for each GrayscaleMode
+    static const int MODES[GRAYSCALE_MODE_COUNT] = { MODE_SERIAL, MODE_HOST_THREADS, MODE_OPENCL_CPU, MODE_OPENCL_GPU, MODE_OPENCL_HYBRID, MODE_MULTI, MODE_AUTO };
+    if (mode < 0 || mode >= GRAYSCALE_MODE_COUNT || (channels != 1 && channels != 3) || stride < width * sizeof(Pixel))
+        return -1;
+
+    Library& lib = library();
+    lock_guard<mutex> guard(lib.lock);
+    if (!lib.loaded)
+    {
+        loadDevices(lib.state, lib.kernelFile.c_str());
+        lib.loaded = true;
+    }
+
+    const Pixel* pixels = (const Pixel*)rgb;
+    if (stride != width * sizeof(Pixel))
+    {
+        // the filters and devices work on one contiguous run of pixels
+        lib.packed.resize(width * height);
+        for (size_t y = 0; y < height; ++y)
+            memcpy(&lib.packed[y * width], rgb + y * stride, width * sizeof(Pixel));
+        pixels = lib.packed.data();
+    }
+
+    RunState& state = lib.state;
+    // the filters only read the input
+    state.pixels = const_cast<Pixel*>(pixels);
+    state.newPixels = (Pixel*)out;
+    state.width = width;
+    state.height = height;
+    state.grayOutput = channels == 1;
+    double elapsed;
+    const int result = runMode(MODES[mode], state, elapsed);
+    // the buffers belong to the caller
+    state.pixels = NULL;
+    state.newPixels = NULL;
+    return result;
+}
+
+int loadJpeg(const char* name, uint8_t*& rgb, size_t& width, size_t& height)
+{
+    Pixel* pixels;
+    unsigned long int w, h;
+    if (readImage(name, pixels, w, h) == -1)
+        return -1;
+    rgb = (uint8_t*)pixels;
+    width = w;
+    height = h;
+    return 0;
+}
+
+void freeJpeg(uint8_t* rgb)
+{
+    alignedFree(rgb);
+}
+
+int saveJpeg(const char* name, const uint8_t* pixels, size_t width, size_t height, int channels)
+{
+    if (channels == 1)
+        return writeGrayImage(name, pixels, width, height);
+    if (channels == 3)
+        return writeImage(name, (const Pixel*)pixels, width, height);
+    return -1;
+}
+
+int processFile(const char* inName, const char* outName, int mode, int channels)
+{
+    uint8_t* rgb;
+    size_t width, height;
+    if (loadJpeg(inName, rgb, width, height) == -1)
+        return -1;
+    uint8_t* out = (uint8_t*)alignedMalloc(width * height * channels, PAGE_ALIGNMENT);
+    int result = process(rgb, width, height, width * sizeof(Pixel), out, mode, channels);
+    if (result == 0)
+        result = saveJpeg(outName, out, width, height, channels);
+    freeJpeg(rgb);
+    alignedFree(out);
+    return result;
+}
@@ -0,0 +1,61 @@
+// in-process grayscale filtering of image buffers and jpeg files,
+// the same filters the program runs without its menu or disk round trips
+#ifndef GRAYSCALE_H
+#define GRAYSCALE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// where process() runs the (max + min) / 2 grayscale filter
+enum GrayscaleMode
+{
+    // one host thread, with SIMD where the CPU has it
+    GRAYSCALE_SERIAL = 0,
+    // one host thread per core
+    GRAYSCALE_THREADS,
+    // the fastest OpenCL device of the type, by calibration
+    GRAYSCALE_OPENCL_CPU,
+    GRAYSCALE_OPENCL_GPU,
+    // the OpenCL CPU and GPU devices sharing the image
+    GRAYSCALE_HYBRID,
+    // every OpenCL device, each with a slice sized by its speed
+    GRAYSCALE_ALL_DEVICES,
+    // whichever of the above the cost model learned from past runs expects
+    // to be fastest for the image's size
+    GRAYSCALE_AUTO,
+    GRAYSCALE_MODE_COUNT
+};
+
+// where the OpenCL kernels are read from (default main.cl) and built programs
+// are cached (default clcache, empty for no caching), only before the first process()
+void setKernelFile(const char* path);
+void setProgramCache(const char* dir);
+// where the calibrated speed of each OpenCL device is kept, NULL (the default)
+// to keep it in memory only. picking the fastest of several devices of a type
+// calibrates the ones the file doesn't have, once per process without a file
+void setScoreFile(const char* path);
+// tune the kernel variant and work-group size of each OpenCL device and output
+// on its first use and keep the results in path, NULL (the default) for no
+// tuning, the devices then go by their preferred vector width. tuning takes
+// a few seconds per device, which the first process() call on it pays for
+void setTuneFile(const char* path);
+// log every run to path and learn from it for GRAYSCALE_AUTO, NULL (the default)
+// to learn nothing and write no file, GRAYSCALE_AUTO then goes by timing
+// each mode on made up images once
+void setCostFile(const char* path);
+
+// filter a width x height image of packed rgb rows that start stride bytes apart
+// into out, which gets width * height * channels bytes: 3 per pixel for rgb or
+// 1 for gray. returns 0 or -1. calls are serialized, and the devices and
+// threads set up by the first one are reused by the next ones
+int process(const uint8_t* rgb, size_t width, size_t height, size_t stride, uint8_t* out, int mode, int channels = 3);
+
+// read a jpeg into newly allocated, page aligned packed rgb, released with freeJpeg()
+int loadJpeg(const char* name, uint8_t*& rgb, size_t& width, size_t& height);
+void freeJpeg(uint8_t* rgb);
+// write packed rgb (channels 3) or gray (channels 1) as a jpeg
+int saveJpeg(const char* name, const uint8_t* pixels, size_t width, size_t height, int channels = 3);
+// loadJpeg, process and saveJpeg in one go
+int processFile(const char* inName, const char* outName, int mode, int channels = 3);
+
+#endif // GRAYSCALE_H
@@ -19,3 +19,120 @@ __kernel void grayscale(__global Pixel* pixels, __global Pixel* outPixels)
     outPixels[gid].g = gray;
     outPixels[gid].b = gray;
 }
+
+// the same filter for one channel output, a third of the bytes to write and read back
+__kernel void grayscaleGray(__global Pixel* pixels, __global uchar* outGray)
+{
+    unsigned long gid = get_global_id(0);
+    const int r = pixels[gid].r;
+    const int g = pixels[gid].g;
+    const int b = pixels[gid].b;
+    const int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    const int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    outGray[gid] = (max + min) / 2;
+}
+
+// the variants below read the pixels as a flat uchar array, n pixels per
+// work-item in three vector loads, and split them into r, g and b vectors.
+// hadd is (max + min) >> 1 without overflowing a uchar, the same as above.
+// the host runs the pixels that don't fill a whole work-item through the
+// one pixel kernels, with a global offset
+
+__kernel void grayscaleX4(__global const uchar* pixels, __global uchar* outPixels)
+{
+    const size_t gid = get_global_id(0);
+    const uchar4 a = vload4(gid * 3, pixels);
+    const uchar4 b = vload4(gid * 3 + 1, pixels);
+    const uchar4 c = vload4(gid * 3 + 2, pixels);
+    const uchar4 red = (uchar4)(a.s03, b.s2, c.s1);
+    const uchar4 green = (uchar4)(a.s1, b.s03, c.s2);
+    const uchar4 blue = (uchar4)(a.s2, b.s1, c.s03);
+    const uchar4 gray = hadd(max(max(red, green), blue), min(min(red, green), blue));
+    vstore4(gray.s0001, gid * 3, outPixels);
+    vstore4(gray.s1122, gid * 3 + 1, outPixels);
+    vstore4(gray.s2333, gid * 3 + 2, outPixels);
+}
+
+__kernel void grayscaleGrayX4(__global const uchar* pixels, __global uchar* outGray)
+{
+    const size_t gid = get_global_id(0);
+    const uchar4 a = vload4(gid * 3, pixels);
+    const uchar4 b = vload4(gid * 3 + 1, pixels);
+    const uchar4 c = vload4(gid * 3 + 2, pixels);
+    const uchar4 red = (uchar4)(a.s03, b.s2, c.s1);
+    const uchar4 green = (uchar4)(a.s1, b.s03, c.s2);
+    const uchar4 blue = (uchar4)(a.s2, b.s1, c.s03);
+    vstore4(hadd(max(max(red, green), blue), min(min(red, green), blue)), gid, outGray);
+}
+
+__kernel void grayscaleX8(__global const uchar* pixels, __global uchar* outPixels)
+{
+    const size_t gid = get_global_id(0);
+    const uchar8 a = vload8(gid * 3, pixels);
+    const uchar8 b = vload8(gid * 3 + 1, pixels);
+    const uchar8 c = vload8(gid * 3 + 2, pixels);
+    const uchar8 red = (uchar8)(a.s036, b.s147, c.s25);
+    const uchar8 green = (uchar8)(a.s147, b.s25, c.s036);
+    const uchar8 blue = (uchar8)(a.s25, b.s036, c.s147);
+    const uchar8 gray = hadd(max(max(red, green), blue), min(min(red, green), blue));
+    vstore8(gray.s00011122, gid * 3, outPixels);
+    vstore8(gray.s23334445, gid * 3 + 1, outPixels);
+    vstore8(gray.s55666777, gid * 3 + 2, outPixels);
+}
+
+__kernel void grayscaleGrayX8(__global const uchar* pixels, __global uchar* outGray)
+{
+    const size_t gid = get_global_id(0);
+    const uchar8 a = vload8(gid * 3, pixels);
+    const uchar8 b = vload8(gid * 3 + 1, pixels);
+    const uchar8 c = vload8(gid * 3 + 2, pixels);
+    const uchar8 red = (uchar8)(a.s036, b.s147, c.s25);
+    const uchar8 green = (uchar8)(a.s147, b.s25, c.s036);
+    const uchar8 blue = (uchar8)(a.s25, b.s036, c.s147);
+    vstore8(hadd(max(max(red, green), blue), min(min(red, green), blue)), gid, outGray);
+}
+
+// 16 pixels of the flat array starting at pixel 16 * group
+uchar16 lightness16(__global const uchar* pixels, const size_t group)
+{
+    const uchar16 a = vload16(group * 3, pixels);
+    const uchar16 b = vload16(group * 3 + 1, pixels);
+    const uchar16 c = vload16(group * 3 + 2, pixels);
+    const uchar16 red = (uchar16)(a.s0369, a.scf, b.s258b, b.se, c.s147a, c.sd);
+    const uchar16 green = (uchar16)(a.s147a, a.sd, b.s0369, b.scf, c.s258b, c.se);
+    const uchar16 blue = (uchar16)(a.s258b, a.se, b.s147a, b.sd, c.s0369, c.scf);
+    return hadd(max(max(red, green), blue), min(min(red, green), blue));
+}
+
+void storeRgb16(const uchar16 gray, const size_t group, __global uchar* outPixels)
+{
+    vstore16(gray.s0001112223334445, group * 3, outPixels);
+    vstore16(gray.s55666777888999aa, group * 3 + 1, outPixels);
+    vstore16(gray.sabbbcccdddeeefff, group * 3 + 2, outPixels);
+}
+
+__kernel void grayscaleX16(__global const uchar* pixels, __global uchar* outPixels)
+{
+    const size_t gid = get_global_id(0);
+    storeRgb16(lightness16(pixels, gid), gid, outPixels);
+}
+
+__kernel void grayscaleGrayX16(__global const uchar* pixels, __global uchar* outGray)
+{
+    const size_t gid = get_global_id(0);
+    vstore16(lightness16(pixels, gid), gid, outGray);
+}
+
+// a fixed number of work-items walk the groups of 16 pixels,
+// each one moving on by the whole grid
+__kernel void grayscaleStride(__global const uchar* pixels, __global uchar* outPixels, const ulong groups)
+{
+    for (size_t group = get_global_id(0); group < groups; group += get_global_size(0))
+        storeRgb16(lightness16(pixels, group), group, outPixels);
+}
+
+__kernel void grayscaleGrayStride(__global const uchar* pixels, __global uchar* outGray, const ulong groups)
+{
+    for (size_t group = get_global_id(0); group < groups; group += get_global_size(0))
+        vstore16(lightness16(pixels, group), group, outGray);
+}
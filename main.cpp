@@ -1,491 +1,786 @@
-#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include "engine.h"
+#include "daemon.h"
 
-#include <iostream>
-#include <algorithm>
-#include <chrono>
-#include <vector>
 #include <fstream>
-#include <string>
-extern "C"
-{
-    #include "lib/jpeglib.h"
-}
-#ifdef __APPLE__
-    #include <OpenCL/cl.h>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <deque>
+#ifdef _WIN32
+    #include <io.h>
 #else
-    #include <CL/cl.h>
+    #include <dirent.h>
 #endif
-#include "cl.hpp"
-
-using namespace std;
 
-struct Pixel
+struct BenchmarkOptions
 {
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
+    int mode;
+    int iterations;
+    int warmup;
+    // text, json or csv
+    string report;
+    const char* reportFile;
+    bool writeOutput;
+    // output directory of the batch mode, NULL for a single image
+    const char* batchOut;
+    // images each batch stage may run ahead of the next one
+    unsigned int queueDepth;
 };
 
-int grayscaleFilter(const Pixel* pixels, Pixel*& newPixels, const unsigned long int length)
+// nearest-rank percentile of sorted samples
+double percentile(const vector<double>& sorted, const double p)
+{
+    size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+int runBenchmark(RunState& state, const BenchmarkOptions& options)
 {
-    // iterate through all pixels.
-    for (unsigned long int i = 0; i < length; ++i)
+    double elapsed = 0;
+    // warmup runs pay for setting things up, they'd throw the cost model off
+    const bool learnCosts = state.learnCosts;
+    state.learnCosts = false;
+    for (int i = 0; i < options.warmup; ++i)
+    {
+        if (runMode(options.mode, state, elapsed) == -1)
+        {
+            state.learnCosts = learnCosts;
+            return -1;
+        }
+    }
+    state.learnCosts = learnCosts;
+
+    vector<double> samples;
+    for (int i = 0; i < options.iterations; ++i)
     {
-        const int r = pixels[i].r;
-        const int g = pixels[i].g;
-        const int b = pixels[i].b;
+        if (runMode(options.mode, state, elapsed) == -1)
+            return -1;
+        samples.push_back(elapsed);
+    }
+
+    if (options.writeOutput && !isFileMode(options.mode))
+    {
+        if (saveImage(state) == -1)
+            return -1;
+    }
 
-        // algorithm for grayscaling the pixel
-        const int gray = (max(r, max(g, b)) + min(r, min(g, b))) / 2;
-        // another way but faster:
-        // const double gray_d = (r * 0.3 + g * 0.59 + b * 0.11);
-        // const int gray = (int)(gray_d + 0.5);
+    vector<double> sorted(samples);
+    sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (double sample : samples)
+        sum += sample;
+    const double mean = sum / samples.size();
+    const double median = sorted.size() % 2 == 1 ? sorted[sorted.size() / 2] : (sorted[sorted.size() / 2 - 1] + sorted[sorted.size() / 2]) / 2;
+    const unsigned long int pixelCount = state.width * state.height;
+    // throughput of the typical run
+    const double pixelsPerSec = median > 0 ? pixelCount / (median / 1000) : 0;
+    // the mode the auto mode picked for the last run
+    const int ran = options.mode == MODE_AUTO ? state.autoChoice : options.mode;
+    const bool threaded = ran == MODE_HOST_THREADS;
+    const double efficiency = threaded ? scalingEfficiency(state, median) : 0;
+
+    ofstream reportFile;
+    if (options.reportFile != NULL)
+    {
+        // csv reports are appended so runs can be tracked over time
+        bool append = false;
+        if (options.report == "csv")
+        {
+            ifstream existing(options.reportFile);
+            append = existing.good() && existing.peek() != ifstream::traits_type::eof();
+        }
+        reportFile.open(options.reportFile, append ? ios::app : ios::trunc);
+        if (!reportFile)
+        {
+            cerr << "Can't open report file." << endl;
+            return -1;
+        }
+        if (options.report == "csv" && !append)
+            reportFile << "mode,width,height,warmup,iterations,min_ms,median_ms,mean_ms,p95_ms,p99_ms,max_ms,pixels_per_sec" << endl;
+    }
+    else if (options.report == "csv")
+    {
+        cout << "mode,width,height,warmup,iterations,min_ms,median_ms,mean_ms,p95_ms,p99_ms,max_ms,pixels_per_sec" << endl;
+    }
+    ostream& out = options.reportFile != NULL ? reportFile : cout;
 
-        newPixels[i].r = gray;
-        newPixels[i].g = gray;
-        newPixels[i].b = gray;
+    if (options.report == "json")
+    {
+        out << "{" << endl;
+        out << "  \"mode\": \"" << MODE_NAMES[options.mode] << "\"," << endl;
+        if (options.mode == MODE_AUTO)
+            out << "  \"picked\": \"" << MODE_NAMES[ran] << "\"," << endl;
+        out << "  \"width\": " << state.width << "," << endl;
+        out << "  \"height\": " << state.height << "," << endl;
+        out << "  \"warmup\": " << options.warmup << "," << endl;
+        out << "  \"iterations\": " << options.iterations << "," << endl;
+        out << "  \"min_ms\": " << sorted.front() << "," << endl;
+        out << "  \"median_ms\": " << median << "," << endl;
+        out << "  \"mean_ms\": " << mean << "," << endl;
+        out << "  \"p95_ms\": " << percentile(sorted, 95) << "," << endl;
+        out << "  \"p99_ms\": " << percentile(sorted, 99) << "," << endl;
+        out << "  \"max_ms\": " << sorted.back() << "," << endl;
+        out << "  \"pixels_per_sec\": " << pixelsPerSec << "," << endl;
+        // phase breakdown of the last iteration
+        out << "  \"profile\": [";
+        bool firstSession = true;
+        for (auto const session : state.profiled)
+        {
+            const SessionProfile& profile = session->getProfile();
+            out << (firstSession ? "" : ",") << endl << "    { \"device\": \"" << session->getDevice().getInfo<CL_DEVICE_NAME>() << "\", \"runs\": " << profile.runs
+                << ", \"kernel\": \"" << KERNEL_NAMES[session->getConfig(outputChannels(state)).variant] << "\""
+                << ", \"local_size\": " << session->getConfig(outputChannels(state)).local
+                << ", \"zero_copy\": " << (session->usesZeroCopy() ? "true" : "false")
+                << ", \"strips\": " << profile.strips;
+            for (int phase = 0; phase < PHASE_COUNT; ++phase)
+                out << ", \"" << PHASE_NAMES[phase] << "_ms\": " << profile.busy[phase] << ", \"" << PHASE_NAMES[phase] << "_queued_ms\": " << profile.waiting[phase];
+            out << " }";
+            firstSession = false;
+        }
+        out << (firstSession ? "" : "\n  ") << "]," << endl;
+        if (state.decodeTime >= 0)
+            out << "  \"decode_ms\": " << state.decodeTime << "," << endl;
+        if (state.encodeTime >= 0)
+            out << "  \"encode_ms\": " << state.encodeTime << "," << endl;
+        if (threaded)
+        {
+            out << "  \"threads\": " << state.threadCount << "," << endl;
+            out << "  \"scaling_efficiency\": " << efficiency << "," << endl;
+        }
+        out << "  \"samples_ms\": [";
+        for (size_t i = 0; i < samples.size(); ++i)
+            out << (i > 0 ? ", " : "") << samples[i];
+        out << "]" << endl;
+        out << "}" << endl;
+    }
+    else if (options.report == "csv")
+    {
+        out << MODE_NAMES[options.mode] << "," << state.width << "," << state.height << ","
+            << options.warmup << "," << options.iterations << ","
+            << sorted.front() << "," << median << "," << mean << ","
+            << percentile(sorted, 95) << "," << percentile(sorted, 99) << "," << sorted.back() << ","
+            << pixelsPerSec << endl;
+    }
+    else
+    {
+        out << MODE_TITLES[options.mode] << " (" << state.width << "x" << state.height << ", "
+            << options.warmup << " warmup, " << options.iterations << " iterations)" << endl;
+        out << "min:    " << sorted.front() << " ms" << endl;
+        out << "median: " << median << " ms" << endl;
+        out << "mean:   " << mean << " ms" << endl;
+        out << "p95:    " << percentile(sorted, 95) << " ms" << endl;
+        out << "p99:    " << percentile(sorted, 99) << " ms" << endl;
+        out << "max:    " << sorted.back() << " ms" << endl;
+        out << "pixels/sec: " << pixelsPerSec << endl;
+        if (options.mode == MODE_AUTO)
+            out << "picked: " << MODE_NAMES[ran] << endl;
+        if (ran == MODE_OPENCL_HYBRID || ran == MODE_MULTI)
+            printHybridSplit(out, state.hybridSplit);
+        if (!isFileMode(options.mode))
+            printProfile(out, state);
+        if (threaded)
+            out << "scaling efficiency: " << efficiency * 100 << "% on " << state.threadCount << " threads" << endl;
     }
     return 0;
 }
 
-int readImage(const char* name, struct Pixel*& pixels, unsigned long int& width, unsigned long int& height)
+// stages of the batch pipeline, each runs on its own thread
+enum BatchStage
 {
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    STAGE_DECODE,
+    STAGE_FILTER,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
 
-    // read jpeg file
-    FILE *file;
-    if ((file = fopen(name, "rb")) == NULL)
-        return -1;
+const char* const STAGE_NAMES[STAGE_COUNT] = { "decode", "filter", "encode" };
+
+// a fixed capacity queue between two pipeline stages,
+// push blocks while it is full and pop while it is empty
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(const size_t capacity) : capacity(max((size_t)1, capacity)), closed(false) {}
+
+    void push(const T& item)
+    {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        notEmpty.notify_one();
+    }
+
+    // no more items will be pushed
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& item)
+    {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+private:
+    deque<T> items;
+    const size_t capacity;
+    bool closed;
+    mutex lock;
+    condition_variable notFull;
+    condition_variable notEmpty;
+};
+
+// one image on its way through the batch pipeline
+struct BatchImage
+{
+    string inName;
+    string outName;
+    struct Pixel* pixels;
+    struct Pixel* newPixels;
+    unsigned long int width;
+    unsigned long int height;
+};
+
+bool isJpegName(string name)
+{
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    const size_t dot = name.rfind('.');
+    return dot != string::npos && (name.substr(dot) == ".jpg" || name.substr(dot) == ".jpeg");
+}
 
-    // read jpeg header (width and height)
-    cinfo.err = jpeg_std_error(&jerr);
-    // decompress jpeg format
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, file);
-    (void) jpeg_read_header(&cinfo, (boolean)true);
-    (void) jpeg_start_decompress(&cinfo);
-    width = cinfo.output_width;
-    height = cinfo.output_height;
-
-    // each row is the width times color depth of one pixel
-    unsigned long int row_stride = width * cinfo.output_components;
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray) ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-    pixels = (Pixel*)malloc(width * height * sizeof(Pixel));
-
-    // process image line by line
-    unsigned long int pixelCounter = 0;
-    while (cinfo.output_scanline < cinfo.output_height)
-    {
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        // process line pixels
-        for (unsigned long i = 0; i < width; ++i)
+// the jpeg files of a directory in name order,
+// or the lines of a file that lists one image per line
+int listBatchInputs(const string& input, vector<string>& names)
+{
+#ifdef _WIN32
+    _finddata_t entry;
+    const intptr_t handle = _findfirst((input + "/*").c_str(), &entry);
+    if (handle != -1)
+    {
+        do
         {
-            // assign first color to red
-            pixels[pixelCounter].r = buffer[0][cinfo.output_components * i];
-            // but if a pixel contains more colors
-            if (cinfo.output_components > 2)
-            {
-                pixels[pixelCounter].g = buffer[0][cinfo.output_components * i + 1];
-                pixels[pixelCounter].b = buffer[0][cinfo.output_components * i + 2];
-            }
-            else
-            {
-                pixels[pixelCounter].g = pixels[pixelCounter].r;
-                pixels[pixelCounter].b = pixels[pixelCounter].r;
-            }
-            pixelCounter++;
+            if (!(entry.attrib & _A_SUBDIR) && isJpegName(entry.name))
+                names.push_back(input + "/" + entry.name);
+        } while (_findnext(handle, &entry) == 0);
+        _findclose(handle);
+        sort(names.begin(), names.end());
+        return 0;
+    }
+#else
+    DIR* dir = opendir(input.c_str());
+    if (dir != NULL)
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            if (isJpegName(entry->d_name))
+                names.push_back(input + "/" + entry->d_name);
         }
+        closedir(dir);
+        sort(names.begin(), names.end());
+        return 0;
+    }
+#endif
+    ifstream list(input);
+    if (!list)
+        return -1;
+    string line;
+    while (getline(list, line))
+    {
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (!line.empty())
+            names.push_back(line);
     }
-
-    // close the file
-    fclose(file);
-    (void) jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
     return 0;
 }
 
-int writeImage(const char* name, const struct Pixel* pixels, const unsigned long int width, const unsigned long int height)
+// filter every image of a directory or list file into outDir,
+// decoding, filtering and encoding different images at the same time
+int runBatch(RunState& state, const BenchmarkOptions& options, const string& input, const string& outDir)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    // write to file
-    FILE *file;
-    if ((file = fopen(name, "wb")) == NULL)
+    vector<string> names;
+    if (listBatchInputs(input, names) == -1)
     {
-        cerr << "Can't open output file." << endl;
+        cerr << "Can't read batch input: " << input << endl;
+        return -1;
+    }
+    if (names.size() == 0)
+    {
+        cerr << "No images to process." << endl;
+        return -1;
+    }
+    if (makeDirectory(outDir) == -1)
+    {
+        cerr << "Can't create output directory: " << outDir << endl;
         return -1;
     }
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, file);
-
-    cinfo.image_width = width;  
-    cinfo.image_height = height;
-    // set the image to have three colors
-    // although the image size would be smaller
-    // if we just set it to one and change the color space to grayscaled
-    // but... whatever >w<
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    // each stage only touches its own entries, they are read after the join
+    double busy[STAGE_COUNT] = { 0, 0, 0 };
+    unsigned long int failed[STAGE_COUNT] = { 0, 0, 0 };
+    unsigned long int written = 0;
+    BoundedQueue<BatchImage> decoded(options.queueDepth);
+    BoundedQueue<BatchImage> filtered(options.queueDepth);
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_start_compress(&cinfo, (boolean)true);
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    thread decoder([&]
+    {
+        for (auto const& name : names)
+        {
+            chrono::high_resolution_clock::time_point begin = chrono::high_resolution_clock::now();
+            BatchImage image;
+            image.inName = name;
+            image.outName = outDir + "/" + name.substr(name.find_last_of("/\\") + 1);
+            image.pixels = NULL;
+            if (readImage(name.c_str(), image.pixels, image.width, image.height) == -1)
+            {
+                cerr << "Invalid image file: " << name << endl;
+                failed[STAGE_DECODE]++;
+                continue;
+            }
+            image.newPixels = (Pixel*)alignedMalloc(image.width * image.height * sizeof(Pixel), PAGE_ALIGNMENT);
+            busy[STAGE_DECODE] += elapsedSince(begin);
+            decoded.push(image);
+        }
+        decoded.close();
+    });
+    thread encoder([&]
+    {
+        BatchImage image;
+        while (filtered.pop(image))
+        {
+            chrono::high_resolution_clock::time_point begin = chrono::high_resolution_clock::now();
+            const int result = state.grayOutput
+                ? writeGrayImage(image.outName.c_str(), (unsigned char*)image.newPixels, image.width, image.height)
+                : writeImage(image.outName.c_str(), image.newPixels, image.width, image.height);
+            if (result == -1)
+            {
+                cerr << "Can't write image: " << image.outName << endl;
+                failed[STAGE_ENCODE]++;
+            }
+            else
+                written++;
+            alignedFree(image.pixels);
+            alignedFree(image.newPixels);
+            busy[STAGE_ENCODE] += elapsedSince(begin);
+        }
+    });
 
-    unsigned long int row_stride = width * cinfo.input_components;
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray) ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+    // the filter stage stays on this thread, it owns the OpenCL sessions and the thread pool
+    BatchImage image;
+    while (decoded.pop(image))
+    {
+        chrono::high_resolution_clock::time_point begin = chrono::high_resolution_clock::now();
+        state.pixels = image.pixels;
+        state.newPixels = image.newPixels;
+        state.width = image.width;
+        state.height = image.height;
+        double elapsed = 0;
+        const int result = runMode(options.mode, state, elapsed);
+        busy[STAGE_FILTER] += elapsedSince(begin);
+        if (result == -1)
+        {
+            cerr << "Can't filter image: " << image.inName << endl;
+            failed[STAGE_FILTER]++;
+            alignedFree(image.pixels);
+            alignedFree(image.newPixels);
+            continue;
+        }
+        filtered.push(image);
+    }
+    filtered.close();
+    decoder.join();
+    encoder.join();
+    const double wall = elapsedSince(start);
+    // the images belong to the pipeline, not to the single image state
+    state.pixels = NULL;
+    state.newPixels = NULL;
+
+    const unsigned long int failures = failed[STAGE_DECODE] + failed[STAGE_FILTER] + failed[STAGE_ENCODE];
+    const double imagesPerSec = wall > 0 ? written / (wall / 1000) : 0;
+    // the busiest stage limits the throughput of the whole pipeline
+    int bottleneck = STAGE_DECODE;
+    for (int stage = STAGE_DECODE; stage < STAGE_COUNT; ++stage)
+    {
+        if (busy[stage] > busy[bottleneck])
+            bottleneck = stage;
+    }
 
-    // this is the index of the pixel element we want to fetch
-    unsigned long int counter = 0;
-    while(cinfo.next_scanline < cinfo.image_height)
+    ofstream reportFile;
+    if (options.reportFile != NULL)
     {
-        for (unsigned long i = 0; i < width; ++i)
+        reportFile.open(options.reportFile);
+        if (!reportFile)
         {
-            // set all three colors
-            buffer[0][cinfo.input_components * i] = pixels[counter].r;
-            buffer[0][cinfo.input_components * i + 1] = pixels[counter].g;
-            buffer[0][cinfo.input_components * i + 2] = pixels[counter].b;
-            counter++;
+            cerr << "Can't open report file." << endl;
+            return -1;
         }
-        jpeg_write_scanlines(&cinfo, buffer, 1);
     }
+    ostream& out = options.reportFile != NULL ? reportFile : cout;
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    fclose(file);
+    if (options.report == "json")
+    {
+        out << "{" << endl;
+        out << "  \"mode\": \"" << MODE_NAMES[options.mode] << "\"," << endl;
+        out << "  \"images\": " << written << "," << endl;
+        out << "  \"failed\": " << failures << "," << endl;
+        out << "  \"queue_depth\": " << options.queueDepth << "," << endl;
+        out << "  \"wall_ms\": " << wall << "," << endl;
+        out << "  \"images_per_sec\": " << imagesPerSec << "," << endl;
+        out << "  \"stages\": [";
+        for (int stage = STAGE_DECODE; stage < STAGE_COUNT; ++stage)
+        {
+            out << (stage == STAGE_DECODE ? "" : ",") << endl << "    { \"stage\": \"" << STAGE_NAMES[stage]
+                << "\", \"busy_ms\": " << busy[stage] << ", \"utilization\": " << (wall > 0 ? busy[stage] / wall : 0)
+                << ", \"failed\": " << failed[stage] << " }";
+        }
+        out << endl << "  ]," << endl;
+        out << "  \"bottleneck\": \"" << STAGE_NAMES[bottleneck] << "\"" << endl;
+        out << "}" << endl;
+    }
+    else
+    {
+        out << "Batch " << MODE_NAMES[options.mode] << ": " << written << " images";
+        if (failures > 0)
+            out << " (" << failures << " failed)";
+        out << " in " << wall << " ms, " << imagesPerSec << " images/sec" << endl;
+        for (int stage = STAGE_DECODE; stage < STAGE_COUNT; ++stage)
+        {
+            out << "  " << STAGE_NAMES[stage] << ": " << busy[stage] << " ms busy, "
+                << (wall > 0 ? 100 * busy[stage] / wall : 0) << "% utilized" << endl;
+        }
+        out << "bottleneck: " << STAGE_NAMES[bottleneck] << endl;
+    }
+    return failures == 0 ? 0 : -1;
+}
 
-    cout << "Image saved." << endl;
-    return 0;
+void printUsage(const char* name)
+{
+    cerr << "Usage: " << name << " <file_name.jpg> [options]" << endl;
+    cerr << "       " << name << " <directory | list_file> --batch <output_directory> [options]" << endl;
+    cerr << "       " << name << " --daemon <socket> [options]" << endl;
+    cerr << "Without options an interactive menu is shown." << endl;
+    cerr << "  --mode <name>         run non-interactively: ";
+    for (int i = MODE_SERIAL; i < MODE_COUNT; ++i)
+        cerr << MODE_NAMES[i] << (i + 1 < MODE_COUNT ? ", " : "");
+    cerr << endl;
+    cerr << "  --iterations <n>      measured runs (default 10)" << endl;
+    cerr << "  --warmup <n>          unmeasured runs before measuring (default 1)" << endl;
+    cerr << "  --output <file.jpg>   where the filtered image goes (default out.jpg)" << endl;
+    cerr << "  --no-output           don't write the filtered image" << endl;
+    cerr << "  --gray-output         write one channel grayscale jpegs instead of RGB ones" << endl;
+    cerr << "  --report <format>     text, json or csv (default text)" << endl;
+    cerr << "  --report-file <file>  write the report to a file instead of stdout" << endl;
+    cerr << "  --batch <directory>   filter every image of a directory or list file into a directory," << endl;
+    cerr << "                        with --mode serial, cpu, gpu, hybrid, threads, multi or auto (default: gpu if there is one, else threads)" << endl;
+    cerr << "  --queue-depth <n>     images a batch stage may run ahead of the next (default 2)" << endl;
+    cerr << "  --daemon <socket>     keep the OpenCL programs built and serve jobs from client on a Unix socket" << endl;
+    cerr << "  --simd <level>        host instruction set: scalar, sse4.1, avx2 or avx512 (default: best available)" << endl;
+    cerr << "  --hybrid <workers>    comma separated hybrid workers: cpu, gpu, cpuN, gpuN, host" << endl;
+    cerr << "                        (default: cpu,gpu, or every device plus a host thread)" << endl;
+    cerr << "  --hybrid-chunk <n>    pixels per hybrid chunk (default: 1/" << HYBRID_CHUNKS << " of the image)" << endl;
+    cerr << "  --threads <n>         workers for the threads mode (default: one per core)" << endl;
+    cerr << "  --pin                 pin worker i to core i" << endl;
+    cerr << "  --cl-cache <dir>      where built OpenCL programs are cached (default clcache)" << endl;
+    cerr << "  --no-cl-cache         always build OpenCL programs from source" << endl;
+    cerr << "  --zero-copy <when>    let OpenCL devices work on host memory in place: auto, on or off" << endl;
+    cerr << "                        (default auto: devices that share memory with the host)" << endl;
+    cerr << "  --kernel <variant>    pixels per OpenCL work-item: x1, x4, x8, x16, or stride for a fixed grid" << endl;
+    cerr << "                        walking groups of 16 (default auto: tuned, see --tune-file)" << endl;
+    cerr << "  --tile-pixels <n>     filter images in strips of at most n pixels on OpenCL devices" << endl;
+    cerr << "                        (default: what the device's allocation and memory limits allow)" << endl;
+    cerr << "  --overlap <chunks>    split images into this many strips on OpenCL devices so their transfers and kernels" << endl;
+    cerr << "                        overlap (default 1, off), auto splits by image size where that measures faster" << endl;
+    cerr << "  --scores-file <file>  where the measured speed of each OpenCL device is kept, devices missing from it" << endl;
+    cerr << "                        are calibrated when one of several has to be picked (default clscores.txt)" << endl;
+    cerr << "  --recalibrate         measure every device that has to be picked from again" << endl;
+    cerr << "  --cost-file <file>    where runs are logged for the auto mode's cost model, empty for none (default clcosts.txt)" << endl;
+    cerr << "  --tune-file <file>    where the kernel variant and work-group size tuned per device are kept," << endl;
+    cerr << "                        devices missing from it are tuned on first use (default cltune.txt)" << endl;
+    cerr << "  --no-tune             pick the kernel variant by the device's preferred vector width instead" << endl;
+    cerr << "  --retune              tune every device used again" << endl;
 }
 
 int main(int argc, char** argv)
 {
     if (argc < 2)
     {
-        cerr << "Usage: " << argv[0] << " <file_name.jpg>" << endl;
+        printUsage(argv[0]);
         return -1;
     }
 
-    // this is where we store the original image pixels
-    struct Pixel* pixels;
-    unsigned long int width;
-    unsigned long int height;
-    
-    if (readImage(argv[1], pixels, width, height) == -1)
+    RunState state;
+    // the daemon takes no input image
+    const bool hasInput = string(argv[1]).compare(0, 2, "--") != 0;
+    if (hasInput)
+        state.inName = argv[1];
+    const char* daemonSocket = NULL;
+
+    BenchmarkOptions options;
+    options.mode = MODE_EXIT;
+    options.iterations = 10;
+    options.warmup = 1;
+    options.report = "text";
+    options.reportFile = NULL;
+    options.writeOutput = true;
+    options.batchOut = NULL;
+    options.queueDepth = 2;
+
+    // parse command line options
+    for (int i = hasInput ? 2 : 1; i < argc; ++i)
     {
-        cerr << "Invalid image file." << endl;
+        const string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--mode" && hasValue)
+        {
+            const string name = argv[++i];
+            for (int m = MODE_SERIAL; m < MODE_COUNT; ++m)
+            {
+                if (name == MODE_NAMES[m])
+                    options.mode = m;
+            }
+            if (options.mode == MODE_EXIT)
+            {
+                cerr << "Unknown mode: " << name << endl;
+                return -1;
+            }
+        }
+        else if (arg == "--iterations" && hasValue)
+            options.iterations = max(1, atoi(argv[++i]));
+        else if (arg == "--warmup" && hasValue)
+            options.warmup = max(0, atoi(argv[++i]));
+        else if (arg == "--output" && hasValue)
+            state.outName = argv[++i];
+        else if (arg == "--no-output")
+            options.writeOutput = false;
+        else if (arg == "--gray-output")
+            state.grayOutput = true;
+        else if (arg == "--report" && hasValue)
+            options.report = argv[++i];
+        else if (arg == "--report-file" && hasValue)
+            options.reportFile = argv[++i];
+        else if (arg == "--batch" && hasValue)
+            options.batchOut = argv[++i];
+        else if (arg == "--queue-depth" && hasValue)
+            options.queueDepth = max(1, atoi(argv[++i]));
+        else if (arg == "--daemon" && hasValue)
+            daemonSocket = argv[++i];
+        else if (arg == "--simd" && hasValue)
+        {
+            const string name = argv[++i];
+            const SimdLevel best = detectSimdLevel();
+            int level = SIMD_COUNT;
+            for (int l = SIMD_SCALAR; l < SIMD_COUNT; ++l)
+            {
+                if (name == SIMD_NAMES[l])
+                    level = l;
+            }
+            if (level == SIMD_COUNT || level > best)
+            {
+                cerr << "Unsupported SIMD level: " << name << endl;
+                return -1;
+            }
+            simdLevel = (SimdLevel)level;
+        }
+        else if (arg == "--hybrid" && hasValue)
+            state.hybridWorkers = argv[++i];
+        else if (arg == "--hybrid-chunk" && hasValue)
+            state.hybridChunk = strtoul(argv[++i], NULL, 10);
+        else if (arg == "--threads" && hasValue)
+            state.threadCount = max(1, atoi(argv[++i]));
+        else if (arg == "--pin")
+            state.pinThreads = true;
+        else if (arg == "--cl-cache" && hasValue)
+            state.cacheDir = argv[++i];
+        else if (arg == "--no-cl-cache")
+            state.cacheDir.clear();
+        else if (arg == "--zero-copy" && hasValue)
+        {
+            const string name = argv[++i];
+            int zeroCopy = ZERO_COPY_COUNT;
+            for (int z = ZERO_COPY_AUTO; z < ZERO_COPY_COUNT; ++z)
+            {
+                if (name == ZERO_COPY_NAMES[z])
+                    zeroCopy = z;
+            }
+            if (zeroCopy == ZERO_COPY_COUNT)
+            {
+                cerr << "Unknown zero copy setting: " << name << endl;
+                return -1;
+            }
+            state.zeroCopy = (ZeroCopy)zeroCopy;
+        }
+        else if (arg == "--tile-pixels" && hasValue)
+            state.tilePixels = strtoul(argv[++i], NULL, 10);
+        else if (arg == "--overlap" && hasValue)
+        {
+            const string chunks = argv[++i];
+            state.overlapChunks = chunks == "auto" ? 0 : strtoul(chunks.c_str(), NULL, 10);
+            if (chunks != "auto" && state.overlapChunks == 0)
+            {
+                cerr << "Invalid overlap: " << chunks << endl;
+                return -1;
+            }
+        }
+        else if (arg == "--scores-file" && hasValue)
+            state.scoreFile = argv[++i];
+        else if (arg == "--recalibrate")
+            state.recalibrate = true;
+        else if (arg == "--cost-file" && hasValue)
+            state.costFile = argv[++i];
+        else if (arg == "--tune-file" && hasValue)
+            state.tuneFile = argv[++i];
+        else if (arg == "--no-tune")
+            state.tuneFile.clear();
+        else if (arg == "--retune")
+            state.retune = true;
+        else if (arg == "--kernel" && hasValue)
+        {
+            const string name = argv[++i];
+            int variant = KERNEL_VARIANT_COUNT;
+            for (int v = KERNEL_AUTO; v < KERNEL_VARIANT_COUNT; ++v)
+            {
+                if (name == KERNEL_NAMES[v])
+                    variant = v;
+            }
+            if (variant == KERNEL_VARIANT_COUNT)
+            {
+                cerr << "Unknown kernel: " << name << endl;
+                return -1;
+            }
+            state.kernelVariant = (KernelVariant)variant;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (options.report != "text" && options.report != "json" && options.report != "csv")
+    {
+        cerr << "Unknown report format: " << options.report << endl;
         return -1;
     }
-
-    cout << "Image reading completed." << endl;
-
-    // get OpenCL device lists
-    vector<cl::Platform> platforms;
-    cl::Platform::get(&platforms);
-    if (platforms.size() == 0)
+    if ((daemonSocket != NULL) == hasInput)
     {
-        cout << "No valid OpenCL platform." << endl;
+        printUsage(argv[0]);
         return -1;
     }
-    vector<cl::Device> clDevicesCPU;
-    vector<cl::Device> clDevicesGPU;
+    if (options.batchOut != NULL)
+    {
+        if (isFileMode(options.mode))
+        {
+            cerr << "Streaming, luma and transcode modes can't be used in batch mode." << endl;
+            return -1;
+        }
+        if (options.report == "csv")
+        {
+            cerr << "Batch mode reports text or json." << endl;
+            return -1;
+        }
+    }
+    // reports on stdout should not be mixed with progress messages
+    state.quiet = (options.mode != MODE_EXIT || options.batchOut != NULL) && options.reportFile == NULL && options.report != "text";
 
-    // store devices from different platforms into lists
-    // where they should belong to
-    for (auto const& platform : platforms)
+    if (daemonSocket == NULL && options.batchOut == NULL && readImageInfo(state.inName, state.width, state.height) == -1)
     {
-        vector<cl::Device> clTmpCPU;
-        vector<cl::Device> clTmpGPU;
+        cerr << "Invalid image file." << endl;
+        return -1;
+    }
 
-        platform.getDevices(CL_DEVICE_TYPE_CPU, &clTmpCPU);
-        platform.getDevices(CL_DEVICE_TYPE_GPU, &clTmpGPU);
+    if (!state.quiet)
+        cout << "Host SIMD: " << SIMD_NAMES[simdLevel] << endl;
 
-        if (clTmpCPU.size() > 0)
-            copy(clTmpCPU.begin(), clTmpCPU.end(), back_inserter(clDevicesCPU));
-        if (clTmpGPU.size() > 0)
-            copy(clTmpGPU.begin(), clTmpGPU.end(), back_inserter(clDevicesGPU));
+    // get OpenCL device lists and the kernels,
+    // the serial modes still work without any
+    const int platformCount = loadDevices(state, "main.cl");
+    if (platformCount > 0 && state.clDevicesCPU.size() == 0 && state.clDevicesGPU.size() == 0)
+    {
+        cerr << "No valid OpenCL device." << endl;
+    }
+    else if (!state.quiet)
+    {
+        cout << "OpenCL CPU device count: " << state.clDevicesCPU.size() << endl;
+        cout << "OpenCL GPU device count: " << state.clDevicesGPU.size() << endl;
     }
 
-    // shut the program down if no available device found
-    if (clDevicesCPU.size() == 0 && clDevicesGPU.size() == 0)
+    int result = 0;
+    if (daemonSocket != NULL)
     {
-        cout << "No valid OpenCL device." << endl;
-        return -1;
+        result = runDaemon(state, daemonSocket);
+    }
+    else if (options.batchOut != NULL)
+    {
+        if (options.mode == MODE_EXIT)
+            options.mode = state.clDevicesGPU.size() > 0 ? MODE_OPENCL_GPU : MODE_HOST_THREADS;
+        result = runBatch(state, options, state.inName, options.batchOut);
+    }
+    else if (options.mode != MODE_EXIT)
+    {
+        result = runBenchmark(state, options);
     }
     else
     {
-        cout << "OpenCL CPU device count: " << clDevicesCPU.size() << endl;
-        cout << "OpenCL GPU device count: " << clDevicesGPU.size() << endl;
-    }
-
-    // read the OpenCL instructions from file
-    fstream clFile("main.cl");
-    string clSrc(istreambuf_iterator<char>(clFile), (istreambuf_iterator<char>()));
-    cl::Program::Sources sources(1, make_pair(clSrc.c_str(), clSrc.length() + 1));
-
-    // the program's main logic loop
-    bool loop = true;
-    int selection;
-    while (loop)
-    {
-        cout << endl;
-        cout << "0. Exit program." << endl;
-        cout << "1. Serial." << endl;
-        cout << "2. OpenCL CPU." << endl;
-        cout << "3. OpenCL GPU." << endl;
-        cout << "4. OpenCL CPU + GPU." << endl;
-        cout << "Please select: ";
-        cin >> selection;
-
-        const int selMin = 0;
-        const int selMax = 4;
-        const int sel = selection < selMin ? selMin : selection > selMax ? selMax : selection;
-        switch (sel)
+        // the program's main logic loop
+        bool loop = true;
+        int selection;
+        while (loop)
         {
-            case 0:
+            cout << endl;
+            for (int i = MODE_EXIT; i < MODE_COUNT; ++i)
+                cout << i << ". " << MODE_TITLES[i] << "." << endl;
+            cout << "Please select: ";
+            if (!(cin >> selection))
+                selection = MODE_EXIT;
+
+            const int selMin = MODE_EXIT;
+            const int selMax = MODE_COUNT - 1;
+            const int sel = selection < selMin ? selMin : selection > selMax ? selMax : selection;
+            if (sel == MODE_EXIT)
             {
                 cout << "Bye." << endl;
                 loop = false;
-                break;
-            }
-            case 1:
-            {
-                // serial
-                chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-                struct Pixel* newPixels = (Pixel*)malloc(width * height * sizeof(Pixel));;
-                grayscaleFilter(pixels, newPixels, width * height);
-                chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
-                double elapsed = chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / (double)1000000;
-                cout << endl << "Serial elapsed time: " << elapsed << " ms" << endl;
-                writeImage("out.jpg", newPixels, width, height);
-                delete newPixels;
-                break;
-            }
-            case 2:
-            {
-                // OpenCL CPU
-                if (clDevicesCPU.size() == 0)
-                {
-                    cerr << "No available OpenCL CPU device." << endl;
-                    break;
-                }
-                cl::Device device = clDevicesCPU.front();
-
-                // if more than one CPU devices found
-                // select the most powerful one
-                long lastRecordedPower = -1;
-                if (clDevicesCPU.size() > 1)
-                {
-                    for (size_t i = 0; i < clDevicesCPU.size(); ++i)
-                    {
-                        int maxComputeUnits;
-                        int maxFrequency;
-                        clDevicesCPU[i].getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &maxComputeUnits);
-                        clDevicesCPU[i].getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &maxFrequency);
-                        long power = maxComputeUnits * maxFrequency;
-                        if (power > lastRecordedPower)
-                        {
-                            device = clDevicesCPU[i];
-                            lastRecordedPower = power;
-                        }
-                    }
-                }
-
-                cl::Context context(device);
-                cl::Program program(context, sources);
-                auto err = program.build("-cl-std=CL1.2");
-
-                // create buffers for in and out
-                cl::Buffer clBuff(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, sizeof(Pixel) * width * height, pixels);
-                cl::Buffer clOutBuff(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(Pixel) * width * height);
-                cl::Kernel kernel(program, "grayscale", &err);
-                kernel.setArg(0, clBuff);
-                kernel.setArg(1, clOutBuff);
-
-                cl::CommandQueue queue(context, device);
-
-                chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-
-                struct Pixel* newPixels = (Pixel*)malloc(width * height * sizeof(Pixel));
-                queue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(width * height));
-                queue.enqueueReadBuffer(clOutBuff, CL_FALSE, 0, sizeof(Pixel) * width * height, newPixels);
-                queue.finish();
-
-                chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
-                double elapsed = chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / (double)1000000;
-                cout << endl << "OpenCL CPU elapsed time: " << elapsed << " ms" << endl;
-
-                // save the output image
-                writeImage("out.jpg", newPixels, width, height);
-                delete newPixels;
-                break;
-            }
-            case 3:
-            {
-                // OpenCL GPU
-                if (clDevicesGPU.size() == 0)
-                {
-                    cerr << "No available OpenCL GPU device." << endl;
-                    break;
-                }
-                cl::Device device = clDevicesGPU.front();
-
-                // if more than one GPU devices found
-                // select the most powerful one
-                long lastRecordedPower = -1;
-                if (clDevicesGPU.size() > 1)
-                {
-                    for (size_t i = 0; i < clDevicesGPU.size(); ++i)
-                    {
-                        int maxComputeUnits;
-                        int maxFrequency;
-                        clDevicesGPU[i].getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &maxComputeUnits);
-                        clDevicesGPU[i].getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &maxFrequency);
-                        long power = maxComputeUnits * maxFrequency;
-                        if (power > lastRecordedPower)
-                        {
-                            device = clDevicesGPU[i];
-                            lastRecordedPower = power;
-                        }
-                    }
-                }
-
-                cl::Context context(device);
-                cl::Program program(context, sources);
-                auto err = program.build("-cl-std=CL1.2");
-
-                // create buffers
-                cl::Buffer clBuff(context, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, sizeof(Pixel) * width * height, pixels);
-                cl::Buffer clOutBuff(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(Pixel) * width * height);
-                cl::Kernel kernel(program, "grayscale", &err);
-                kernel.setArg(0, clBuff);
-                kernel.setArg(1, clOutBuff);
-
-                cl::CommandQueue queue(context, device);
-
-                chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-
-                struct Pixel* newPixels = (Pixel*)malloc(width * height * sizeof(Pixel));
-                queue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(width * height));
-                queue.enqueueReadBuffer(clOutBuff, CL_FALSE, 0, sizeof(Pixel) * width * height, newPixels);
-                queue.finish();
-
-                chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
-                double elapsed = chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / (double)1000000;
-                cout << endl << "OpenCL GPU elapsed time: " << elapsed << " ms" << endl;
-
-                // save the output image
-                writeImage("out.jpg", newPixels, width, height);
-                delete newPixels;
-                break;
-            }
-            case 4:
-            {
-                // OpenCL CPU + GPU
-                if (clDevicesCPU.size() == 0 || clDevicesGPU.size() == 0)
-                {
-                    cerr << "Missing OpenCL CPU or GPU device." << endl;
-                    break;
-                }
-
-                // split the work evenly for CPU and GPU
-                unsigned long int sizeTotal = width * height;
-                unsigned long int sizeCPU = sizeTotal / 2;
-                unsigned long int sizeGPU = sizeTotal - sizeCPU;
-
-                cl::Device deviceCPU = clDevicesCPU.front();
-                cl::Device deviceGPU = clDevicesGPU.front();
-
-                // select the most powerful CPU
-                long lastRecordedPowerCPU = -1;
-                if (clDevicesCPU.size() > 1)
-                {
-                    for (size_t i = 0; i < clDevicesCPU.size(); ++i)
-                    {
-                        int maxComputeUnits;
-                        int maxFrequency;
-                        clDevicesCPU[i].getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &maxComputeUnits);
-                        clDevicesCPU[i].getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &maxFrequency);
-                        long power = maxComputeUnits * maxFrequency;
-                        if (power > lastRecordedPowerCPU)
-                        {
-                            deviceCPU = clDevicesCPU[i];
-                            lastRecordedPowerCPU = power;
-                        }
-                    }
-                }
-
-                // select the most powerful GPU
-                long lastRecordedPowerGPU = -1;
-                if (clDevicesGPU.size() > 1)
-                {
-                    for (size_t i = 0; i < clDevicesGPU.size(); ++i)
-                    {
-                        int maxComputeUnits;
-                        int maxFrequency;
-                        clDevicesGPU[i].getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &maxComputeUnits);
-                        clDevicesGPU[i].getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &maxFrequency);
-                        long power = maxComputeUnits * maxFrequency;
-                        if (power > lastRecordedPowerGPU)
-                        {
-                            deviceGPU = clDevicesGPU[i];
-                            lastRecordedPowerGPU = power;
-                        }
-                    }
-                }
-
-                // create contexts and programs
-                cl::Context contextCPU(deviceCPU);
-                cl::Context contextGPU(deviceGPU);
-                cl::Program programCPU(contextCPU, sources);
-                cl::Program programGPU(contextGPU, sources);
-                auto err = programCPU.build("-cl-std=CL1.2");
-                err = programGPU.build("-cl-std=CL1.2");
-
-                // create buffers for each device
-                cl::Buffer clBuffCPU(contextCPU, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, sizeof(Pixel) * sizeCPU, pixels);
-                cl::Buffer clOutBuffCPU(contextCPU, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(Pixel) * sizeCPU);
-                cl::Kernel kernelCPU(programCPU, "grayscale", &err);
-                kernelCPU.setArg(0, clBuffCPU);
-                kernelCPU.setArg(1, clOutBuffCPU);
-
-                cl::Buffer clBuffGPU(contextGPU, CL_MEM_READ_ONLY | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR, sizeof(Pixel) * sizeGPU, pixels + sizeCPU);
-                cl::Buffer clOutBuffGPU(contextGPU, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(Pixel) * sizeGPU);
-                cl::Kernel kernelGPU(programGPU, "grayscale", &err);
-                kernelGPU.setArg(0, clBuffGPU);
-                kernelGPU.setArg(1, clOutBuffGPU);
-
-                // create queues for each
-                cl::CommandQueue queueCPU(contextCPU, deviceCPU);
-                cl::CommandQueue queueGPU(contextGPU, deviceGPU);
-
-                chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-
-                struct Pixel* newPixels = (Pixel*)malloc(width * height * sizeof(Pixel));
-
-                // enqueue half of the image pixels to each device program
-                queueCPU.enqueueNDRangeKernel(kernelCPU, 0, cl::NDRange(sizeCPU));
-                queueGPU.enqueueNDRangeKernel(kernelGPU, 0, cl::NDRange(sizeGPU));
-
-                queueCPU.enqueueReadBuffer(clOutBuffCPU, CL_FALSE, 0, sizeof(Pixel) * sizeCPU, newPixels);
-                queueGPU.enqueueReadBuffer(clOutBuffGPU, CL_FALSE, 0, sizeof(Pixel) * sizeGPU, newPixels + sizeCPU);
-
-                queueCPU.finish();
-                queueGPU.finish();
-
-                chrono::high_resolution_clock::time_point finish = std::chrono::high_resolution_clock::now();
-                double elapsed = chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / (double)1000000;
-                cout << endl << "OpenCL CPU + GPU elapsed time: " << elapsed << " ms" << endl;
-
-                // save the output image
-                writeImage("out.jpg", newPixels, width, height);
-                delete newPixels;
-                break;
+                continue;
             }
+
+            double elapsed = 0;
+            if (runMode(sel, state, elapsed) == -1)
+                continue;
+            cout << endl << MODE_TITLES[sel] << " elapsed time";
+            if (isStreamingMode(sel))
+                cout << " (decode + filter + encode)";
+            else if (sel == MODE_LUMA)
+                cout << " (luma decode + encode)";
+            else if (sel == MODE_TRANSCODE)
+                cout << " (coefficient read + write)";
+            cout << ": " << elapsed << " ms" << endl;
+            const int ran = sel == MODE_AUTO ? state.autoChoice : sel;
+            if (ran == MODE_OPENCL_HYBRID || ran == MODE_MULTI)
+                printHybridSplit(cout, state.hybridSplit);
+            if (ran == MODE_HOST_THREADS)
+                cout << "Scaling efficiency: " << scalingEfficiency(state, elapsed) * 100 << "% on " << state.threadCount << " threads" << endl;
+
+            // save the output image
+            if (isFileMode(sel) || saveImage(state) == 0)
+                cout << "Image saved." << endl;
+            if (!isFileMode(sel))
+                printProfile(cout, state);
         }
     }
 
-    return 0;
+    flushCosts(state);
+    alignedFree(state.pixels);
+    alignedFree(state.newPixels);
+    return result == 0 ? 0 : -1;
 }
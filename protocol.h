@@ -0,0 +1,89 @@
+// the jobs the daemon (program --daemon) and the client exchange over a
+// Unix domain socket: a JobRequest and its payload in, a JobReply and
+// its payload out, any number of jobs per connection
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <csignal>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+// "GRAY", so a stray connection is noticed
+const uint32_t JOB_MAGIC = 0x59415247;
+
+// the daemon reads and writes the files itself
+const uint32_t JOB_PATHS = 0;
+// the jpeg travels over the socket both ways
+const uint32_t JOB_INLINE = 1;
+
+// limits on what the daemon accepts in one job
+const uint64_t JOB_MAX_NAME = 4096;
+const uint64_t JOB_MAX_INPUT = 1ULL << 30;
+
+// followed by the mode name, then the input path or jpeg, then the output path
+struct JobRequest
+{
+    uint32_t magic;
+    uint32_t kind;
+    // bytes per output pixel, 3 for rgb or 1 for gray
+    uint32_t channels;
+    uint32_t modeLength;
+    uint64_t inLength;
+    // 0 for inline jobs
+    uint64_t outLength;
+};
+
+// followed by length bytes of output jpeg for inline jobs
+struct JobReply
+{
+    // 0 or -1
+    int32_t status;
+    uint32_t reserved;
+    // time the daemon spent on the job, in ms
+    double elapsed;
+    uint64_t length;
+};
+
+#ifndef _WIN32
+
+// read exactly length bytes, false on errors, timeouts and at the end of the stream,
+// and when a signal interrupts the read after setting *stop
+inline bool readFully(const int fd, void* data, size_t length, const volatile sig_atomic_t* stop = NULL)
+{
+    char* next = (char*)data;
+    while (length > 0)
+    {
+        const ssize_t count = read(fd, next, length);
+        if (count < 0 && errno == EINTR && (stop == NULL || !*stop))
+            continue;
+        if (count <= 0)
+            return false;
+        next += count;
+        length -= count;
+    }
+    return true;
+}
+
+inline bool writeFully(const int fd, const void* data, size_t length, const volatile sig_atomic_t* stop = NULL)
+{
+    const char* next = (const char*)data;
+    while (length > 0)
+    {
+        const ssize_t count = write(fd, next, length);
+        if (count < 0 && errno == EINTR && (stop == NULL || !*stop))
+            continue;
+        if (count <= 0)
+            return false;
+        next += count;
+        length -= count;
+    }
+    return true;
+}
+
+#endif
+
+#endif // PROTOCOL_H